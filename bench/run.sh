@@ -0,0 +1,63 @@
+#!/bin/sh
+# Compiles the benchmarks in this directory with src/main.um and cc, runs them
+# and prints one json object per benchmark, with the size of the generated c,
+# the wall time, peak rss and the heap counters from KK_HEAP_STATS.
+#
+# usage: bench/run.sh [name...]
+# UMKA, CC and CFLAGS change the tools used, the defaults are umka, cc and -O2.
+
+UMKA=${UMKA:-umka}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# the cold part of the runtime is compiled once, the hot part is inlined into
+# each benchmark from kk_runtime.h
+if ! $CC $CFLAGS -c -o "$tmp/std.o" "$root/static/std.c"; then
+	echo "{\"error\": \"runtime compilation failed\"}"
+	exit 1
+fi
+
+if [ $# -eq 0 ]; then
+	set -- $(cd "$root/bench" && ls *.kk | sed 's/\.kk$//')
+fi
+
+# prints the value of a key=value field of the kk heap line
+field() {
+	echo "$heap" | sed -n "s/.* $1=\([0-9]*\).*/\1/p"
+}
+
+for name in "$@"; do
+	if ! (cd "$root" && "$UMKA" src/main.um "bench/$name.kk") > "$tmp/gen.c" ||
+		! grep -q '^int main' "$tmp/gen.c"; then
+		echo "{\"bench\": \"$name\", \"error\": \"klak compilation failed\"}"
+		continue
+	fi
+
+	if ! $CC $CFLAGS -I"$root/static" -o "$tmp/$name" "$tmp/gen.c" "$tmp/std.o" -lm \
+		2> "$tmp/cc.log"; then
+		echo "{\"bench\": \"$name\", \"error\": \"c compilation failed\"}"
+		continue
+	fi
+
+	start=$(date +%s%N)
+	KK_HEAP_STATS=1 "$tmp/$name" > /dev/null 2> "$tmp/stderr"
+	status=$?
+	end=$(date +%s%N)
+
+	# a run that fails or dies has no heap line to report
+	heap=$(grep '^kk heap: allocs=' "$tmp/stderr")
+	if [ $status -ne 0 ] || [ -z "$heap" ]; then
+		echo "{\"bench\": \"$name\", \"status\": $status, \"error\": \"run failed\"}"
+		continue
+	fi
+
+	echo "{\"bench\": \"$name\", \"status\": $status," \
+		"\"gen_lines\": $(wc -l < "$tmp/gen.c"), \"gen_bytes\": $(wc -c < "$tmp/gen.c")," \
+		"\"wall_ms\": $(( (end - start) / 1000000 )), \"max_rss_kb\": $(field max_rss_kb)," \
+		"\"allocs\": $(field allocs), \"frees\": $(field frees)," \
+		"\"peak_objs\": $(field peak_objs), \"peak_bytes\": $(field peak_bytes)}"
+done
@@ -0,0 +1,503 @@
+// The hot part of the runtime. Generated code includes this header, so the
+// c compiler can inline the stack, arithmetic and reference counting fast
+// paths into the words. The rest of the runtime is in std.c, which is
+// compiled separately.
+#ifndef KK_RUNTIME_H
+#define KK_RUNTIME_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define GCOBJ(a) ((kk_gcobj *)KK_PTR(a))
+#define CONS(a) ((kk_cons *)a->ptr_val)
+#define STR(a) ((kk_string *)a->ptr_val)
+#define TABLE(a) ((kk_table *)a->ptr_val)
+#define STREAM(a) ((kk_stream *)a->ptr_val)
+#define TARRAY(a) ((kk_tarray *)a->ptr_val)
+#define KK_IS_TARRAY(t) ((t) == kk_type_farray || (t) == kk_type_barray)
+#define PUSH(t, f, v) (*++stack = kk_cell_##t(v))
+#define POP() (*stack--)
+#define STACKLEN() (stack - stack_storage)
+#define PAYLOAD(o) ((void *)((kk_gcobj *)(o) + 1))
+
+typedef double kk_float;
+typedef char kk_char;
+typedef char kk_bool;
+
+typedef enum {
+	kk_type_null,
+	kk_type_float,
+	kk_type_char,
+	kk_type_gcobj,
+
+	kk_type_string,
+	kk_type_cons,
+	kk_type_array,
+	kk_type_table,
+	kk_type_int,
+	kk_type_file,
+	kk_type_farray,
+	kk_type_barray,
+} kk_type;
+
+#define KK_TYPES (kk_type_barray + 1)
+
+// Cells are NaN-boxed. Any double is stored as is, other values live in the
+// payload of negative quiet NaNs that the fpu never produces on its own. NaNs
+// from elsewhere (atof, arithmetic) are all stored as KK_NAN, so their payload
+// can't pass for a tag. The top 16 bits are the tag, the low 48 the value.
+// Always go through the macros below instead of touching the bits.
+typedef uint64_t kk_cell;
+
+#define KK_TAG_NULL  0xfff9000000000000ull
+#define KK_TAG_CHAR  0xfffa000000000000ull
+#define KK_TAG_GCOBJ 0xfffb000000000000ull
+#define KK_TAG_INT   0xfffc000000000000ull
+#define KK_PAYLOAD_MASK 0x0000ffffffffffffull
+#define KK_NAN 0x7ff8000000000000ull
+
+#define KK_NULL KK_TAG_NULL
+
+#define KK_IS_FLOAT(c) ((c) < KK_TAG_NULL)
+#define KK_IS_NULL(c) ((c) == KK_NULL)
+#define KK_IS_CHAR(c) (((c) & ~KK_PAYLOAD_MASK) == KK_TAG_CHAR)
+#define KK_IS_GCOBJ(c) (((c) & ~KK_PAYLOAD_MASK) == KK_TAG_GCOBJ)
+#define KK_IS_INT(c) (((c) & ~KK_PAYLOAD_MASK) == KK_TAG_INT)
+#define KK_IS_NUM(c) (KK_IS_FLOAT(c) || KK_IS_INT(c))
+// objects that take part in reference counting
+#define KK_IS_COUNTED(c) (KK_IS_GCOBJ(c) && !GCOBJ(c)->immortal)
+// generated code checks the tag inline, so numbers don't make a call
+#define KK_INC(c) do { if (KK_IS_GCOBJ(c)) kk_gcobj_inc(&(c)); } while (0)
+#define KK_DEC(c) do { if (KK_IS_GCOBJ(c)) kk_gcobj_dec(&(c)); } while (0)
+
+#define KK_FLOAT(c) kk_cell_to_float(c)
+#define KK_CHAR(c) ((kk_char)((c) & 0xff))
+#define KK_PTR(c) ((void *)(uintptr_t)((c) & KK_PAYLOAD_MASK))
+#define KK_INT(c) ((int32_t)(uint32_t)(c))
+#define KK_NUM(c) (KK_IS_INT(c) ? (kk_float)KK_INT(c) : KK_FLOAT(c))
+
+#define KK_INT_FITS(v) ((v) >= INT32_MIN && (v) <= INT32_MAX)
+
+static inline kk_float kk_cell_to_float(kk_cell c) {
+	kk_float f;
+	memcpy(&f, &c, sizeof(f));
+	return f;
+}
+
+static inline kk_cell kk_cell_float(kk_float f) {
+	if (f != f)
+		return KK_NAN;
+
+	kk_cell c;
+	memcpy(&c, &f, sizeof(c));
+	return c;
+}
+
+static inline kk_cell kk_cell_char(kk_char ch) {
+	return KK_TAG_CHAR | (unsigned char)ch;
+}
+
+static inline kk_cell kk_cell_gcobj(void *p) {
+	return KK_TAG_GCOBJ | (uintptr_t)p;
+}
+
+// Integers are only an optimization, to the user they behave like any other
+// float. Results that don't fit are promoted.
+static inline kk_cell kk_cell_int(int32_t i) {
+	return KK_TAG_INT | (uint32_t)i;
+}
+
+static inline kk_cell kk_cell_int64(int64_t i) {
+	return KK_INT_FITS(i) ? kk_cell_int(i) : kk_cell_float(i);
+}
+
+#define kk_cell_null(v) KK_NULL
+
+static inline kk_type kk_cell_type(kk_cell c) {
+	if (KK_IS_FLOAT(c))
+		return kk_type_float;
+
+	switch (c & ~KK_PAYLOAD_MASK) {
+	case KK_TAG_CHAR:
+		return kk_type_char;
+	case KK_TAG_GCOBJ:
+		return kk_type_gcobj;
+	case KK_TAG_INT:
+		return kk_type_int;
+	default:
+		return kk_type_null;
+	}
+}
+
+// ptr_val points to the payload. Fresh objects keep it in the same block,
+// right after the header (see PAYLOAD), it is only moved out when it grows.
+// color and buffered belong to the cycle collector. Immortal objects are
+// never freed and ignore reference counting.
+typedef struct {
+	int refs;
+	unsigned char type;
+	unsigned char color;
+	unsigned char buffered;
+	unsigned char immortal;
+	size_t size;
+	void *ptr_val;
+} kk_gcobj;
+
+// small arrays keep their data inline, like strings. If base isn't null, the
+// cells belong to base, see kk_string.
+typedef struct {
+	int len;
+	int cap;
+	kk_cell *data;
+	kk_cell base;
+} kk_array;
+
+// Typed arrays store raw values instead of cells, doubles for float arrays
+// and bytes for byte arrays. Like arrays, they start with their data inline
+// and can share it with a base.
+typedef struct {
+	int len;
+	int cap;
+	union {
+		void *data;
+		kk_float *f;
+		unsigned char *b;
+	};
+	kk_cell base;
+} kk_tarray;
+
+// The string can contain zeroes, so len is the only source of truth. Small
+// strings keep their data inline after this struct. If base isn't null, data
+// points into memory owned by base and the string holds a reference to it.
+// That's how slices and copies share data. Such strings are detached before
+// they are modified. Strings without a base are always followed by a zero
+// byte, use kk_string_cstr when one is needed.
+typedef struct {
+	size_t len;
+	size_t cap;
+	char *data;
+	kk_cell base;
+} kk_string;
+
+// String literals are emitted as static immortal strings, so pushing one
+// doesn't allocate. Mutating operations copy them first (see kk_string_mut).
+typedef struct {
+	kk_gcobj obj;
+	kk_string str;
+} kk_static_string;
+
+#define KK_STATIC_STRING(name, lit) { \
+	{ 1, kk_type_string, 0, 0, 1, sizeof(kk_static_string), &name.str }, \
+	{ sizeof(lit) - 1, sizeof(lit) - 1, lit, KK_NULL } }
+
+typedef struct _kk_node {
+	struct _kk_node *next;
+	kk_cell cell;
+} kk_node;
+
+typedef struct {
+	kk_cell car;
+	kk_cell cdr;
+} kk_cons;
+
+// An open file. Reads go through buf, pos is the first unread byte. map is the
+// whole file mapped by read, strings returned by it point into the mapping.
+typedef struct {
+	int fd;
+	int owned;
+	char *buf;
+	size_t pos;
+	size_t len;
+	char *map;
+	size_t map_len;
+} kk_stream;
+
+// hash is 0 for empty slots.
+typedef struct {
+	uint32_t hash;
+	kk_cell key;
+	kk_cell val;
+} kk_table_item;
+
+// Open addressing with linear probing. When the table grows, the old items
+// are kept around and moved over a few at a time on each access. Old slots
+// before old_pos were already moved.
+typedef struct {
+	int len;
+	int cap;
+	kk_table_item *items;
+
+	int old_cap;
+	int old_pos;
+	kk_table_item *old;
+} kk_table;
+
+
+extern kk_cell *stack_storage;
+extern kk_cell *stack;
+// Source locations live in kk_locs, which the generated code defines.
+// kk_at is the index of the current one. Generated code only sets it before
+// calls into the runtime, pushes and unchecked pops, and after calls of words.
+// The inline functions get it as a constant argument and set it only when
+// they fail. at is -1 when kk_at is already right. kk_at is volatile because
+// the signal handlers read it, the stores can't be moved past a fault.
+typedef struct {
+	const char *file;
+	int line;
+} kk_loc;
+
+extern const kk_loc kk_locs[];
+extern volatile int kk_at;
+extern const char *type_strs[];
+
+void kk_init(void);
+void kk_runtime_error(char *msg, ...);
+void kk_gcobj_dec(kk_cell *c);
+kk_cell kk_cmp_eq(kk_cell b, kk_cell a, int at);
+
+#define KK_ERROR_AT(at, ...) do { \
+	if ((at) >= 0) \
+		kk_at = (at); \
+	kk_runtime_error(__VA_ARGS__); \
+} while (0)
+
+void kk_prof_init(const char **names, int nwords);
+void kk_prof_enter(int word);
+void kk_prof_leave(void);
+
+void kk_BUILTIN___EQUAL__(void);
+void kk_BUILTIN___DIV____EQUAL__(void);
+void kk_BUILTIN___PLUS__(void);
+void kk_BUILTIN___MINUS__(void);
+void kk_BUILTIN___MUL__(void);
+void kk_BUILTIN___DIV__(void);
+void kk_BUILTIN___MOD__(void);
+void kk_BUILTIN___SMALLER__(void);
+void kk_BUILTIN___BIGGER__(void);
+void kk_BUILTIN___SMALLER____EQUAL__(void);
+void kk_BUILTIN___BIGGER____EQUAL__(void);
+void kk_BUILTIN_s__BIGGER__(void);
+void kk_BUILTIN_cons(void);
+void kk_BUILTIN_car(void);
+void kk_BUILTIN_cdr(void);
+void kk_BUILTIN_uncons(void);
+void kk_BUILTIN_dup(void);
+void kk_BUILTIN_swap(void);
+void kk_BUILTIN_rot(void);
+void kk_BUILTIN_tuck(void);
+void kk_BUILTIN_over(void);
+void kk_BUILTIN_mka(void);
+void kk_BUILTIN_get(void);
+void kk_BUILTIN_set(void);
+void kk_BUILTIN_put(void);
+void kk_BUILTIN_len(void);
+void kk_BUILTIN_nip(void);
+void kk_BUILTIN_num(void);
+void kk_BUILTIN_char(void);
+void kk_BUILTIN_stoa(void);
+void kk_BUILTIN_atos(void);
+void kk_BUILTIN_mkfa(void);
+void kk_BUILTIN_mkba(void);
+void kk_BUILTIN_atofa(void);
+void kk_BUILTIN_atoba(void);
+void kk_BUILTIN_tatoa(void);
+void kk_BUILTIN_fasum(void);
+void kk_BUILTIN_famin(void);
+void kk_BUILTIN_famax(void);
+void kk_BUILTIN_fadot(void);
+void kk_BUILTIN_fa__PLUS__(void);
+void kk_BUILTIN_fa__MINUS__(void);
+void kk_BUILTIN_fa__MUL__(void);
+void kk_BUILTIN_fa__DIV__(void);
+void kk_BUILTIN_fafill(void);
+void kk_BUILTIN_a__BIGGER__(void);
+void kk_BUILTIN_a__SMALLER__(void);
+void kk_BUILTIN_reserve(void);
+void kk_BUILTIN_l__BIGGER__(void);
+void kk_BUILTIN_mkt(void);
+void kk_BUILTIN_contains(void);
+void kk_BUILTIN_split(void);
+void kk_BUILTIN_slice(void);
+void kk_BUILTIN_ttol(void);
+void kk_BUILTIN_open(void);
+void kk_BUILTIN_stdin(void);
+void kk_BUILTIN_read(void);
+void kk_BUILTIN_readl(void);
+void kk_BUILTIN_readb(void);
+void kk_BUILTIN_abs(void);
+void kk_BUILTIN_and(void);
+void kk_BUILTIN_cpy(void);
+void kk_BUILTIN_rcpy(void);
+
+static inline kk_type kk_cell_abstype(kk_cell cell) {
+	if (KK_IS_GCOBJ(cell))
+		return GCOBJ(cell)->type;
+	
+	return kk_cell_type(cell);
+}
+
+// Reference counting is shallow: inc and dec only touch the object's own
+// header. Children are released once their parent is actually freed.
+static inline void kk_gcobj_inc(kk_cell *cell) {
+	if (!KK_IS_COUNTED(*cell))
+		return;
+
+	GCOBJ(*cell)->refs++;
+}
+
+// Pops a value for generated code, which keeps the values above the stack in
+// locals and only loads the ones it needs.
+static inline kk_cell kk_take(int at) {
+	if (stack == stack_storage)
+		KK_ERROR_AT(at, "Stack underflow.");
+
+	return POP();
+}
+
+static inline kk_bool kk_is_true(kk_cell cell) {
+	switch (kk_cell_type(cell)) {
+	case kk_type_char:
+		return KK_CHAR(cell);
+	case kk_type_float:
+		return KK_FLOAT(cell) != 0;
+	case kk_type_int:
+		return KK_INT(cell) != 0;
+	case kk_type_gcobj:
+		return GCOBJ(cell)->ptr_val != NULL;
+	default:
+		return 0;
+	}
+
+	return 0;
+}
+
+// Tests a value and releases it.
+static inline kk_bool kk_truth(kk_cell cell) {
+	kk_bool res = kk_is_true(cell);
+	KK_DEC(cell);
+	return res;
+}
+
+static inline kk_cell kk_cmp_ne(kk_cell b, kk_cell a, int at) {
+	return kk_cell_char(!KK_CHAR(kk_cmp_eq(b, a, at)));
+}
+
+// Arithmetic and comparisons on values, b is the second value and a the top.
+// The builtins apply them to the stack, generated code also calls them on
+// values it keeps in locals. Numbers are added right away, strings and arrays
+// go through the stack, since + appends to them in place.
+static inline kk_cell kk_arith_add(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int64((int64_t)KK_INT(b) + KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_float(KK_NUM(b) + KK_NUM(a));
+
+	*++stack = b;
+	*++stack = a;
+	if (at >= 0)
+		kk_at = at;
+	kk_BUILTIN___PLUS__();
+	return POP();
+}
+
+static inline kk_cell kk_arith_sub(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int64((int64_t)KK_INT(b) - KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_float(KK_NUM(b) - KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot subtract %s from %s.",
+		type_strs[kk_cell_abstype(a)], type_strs[kk_cell_abstype(b)]);
+	return KK_NULL;
+}
+
+static inline kk_cell kk_arith_mul(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int64((int64_t)KK_INT(b) * KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_float(KK_NUM(b) * KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot multiply %s with %s.",
+		type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+	return KK_NULL;
+}
+
+static inline kk_cell kk_arith_div(kk_cell b, kk_cell a, int at) {
+	if (!KK_IS_NUM(a) || !KK_IS_NUM(b)) {
+		KK_ERROR_AT(at, "Cannot divide %s by %s.",
+			type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+		return KK_NULL;
+	}
+
+	if (KK_NUM(a) == 0)
+		KK_ERROR_AT(at, "Division by zero.");
+
+	// only exact int divisions stay ints
+	if (KK_IS_INT(a) && KK_IS_INT(b) && (int64_t)KK_INT(b) % KK_INT(a) == 0)
+		return kk_cell_int64((int64_t)KK_INT(b) / KK_INT(a));
+
+	return kk_cell_float(KK_NUM(b) / KK_NUM(a));
+}
+
+static inline kk_cell kk_arith_mod(kk_cell b, kk_cell a, int at) {
+	if (!KK_IS_NUM(a) || !KK_IS_NUM(b)) {
+		KK_ERROR_AT(at, "Cannot divide %s by %s.",
+			type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+		return KK_NULL;
+	}
+
+	int64_t d = KK_IS_INT(a) ? KK_INT(a) : (int)KK_FLOAT(a);
+	if (d == 0)
+		KK_ERROR_AT(at, "Division by zero.");
+
+	int64_t n = KK_IS_INT(b) ? KK_INT(b) : (int)KK_FLOAT(b);
+	return kk_cell_int64(n % d);
+}
+
+static inline kk_cell kk_cmp_lt(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int(KK_INT(b) < KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_int(KK_NUM(b) < KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot compare %s with %s.",
+		type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+	return KK_NULL;
+}
+
+static inline kk_cell kk_cmp_gt(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int(KK_INT(b) > KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_int(KK_NUM(b) > KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot compare %s with %s.",
+		type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+	return KK_NULL;
+}
+
+static inline kk_cell kk_cmp_le(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int(KK_INT(b) <= KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_int(KK_NUM(b) <= KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot compare %s with %s.",
+		type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+	return KK_NULL;
+}
+
+static inline kk_cell kk_cmp_ge(kk_cell b, kk_cell a, int at) {
+	if (KK_IS_INT(a) && KK_IS_INT(b))
+		return kk_cell_int(KK_INT(b) >= KK_INT(a));
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return kk_cell_int(KK_NUM(b) >= KK_NUM(a));
+
+	KK_ERROR_AT(at, "Cannot compare %s with %s.",
+		type_strs[kk_cell_abstype(b)], type_strs[kk_cell_abstype(a)]);
+	return KK_NULL;
+}
+
+#endif
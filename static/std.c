@@ -1,246 +1,2072 @@
+// for memmem
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KK_SIMD_AVX
+#include <immintrin.h>
+#endif
+
+#include "kk_runtime.h"
+
+// the pool is bypassed under asan, so it can still see every object.
+#if defined(__SANITIZE_ADDRESS__)
+#define KK_HEAP_NOPOOL
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define KK_HEAP_NOPOOL
+#endif
+#endif
+
+#define KK_HEAP_GRAIN 16
+#define KK_HEAP_CLASSES 32
+#define KK_HEAP_MAX_POOLED (KK_HEAP_GRAIN * KK_HEAP_CLASSES)
+#define KK_HEAP_SLAB (64 * 1024)
+
+// colors used by the cycle collector
+#define KK_GC_BLACK 0  // in use or free
+#define KK_GC_GRAY 1   // possible member of a cycle
+#define KK_GC_WHITE 2  // member of a garbage cycle
+#define KK_GC_PURPLE 3 // possible root of a cycle
+
+// only these types can form cycles
+#define KK_GC_TRACED(t) ((t) == kk_type_cons || (t) == kk_type_array || (t) == kk_type_table)
+
+// defaults for the cycle collector thresholds, they can be changed with the
+// KK_GC_ALLOCS and KK_GC_ROOTS environment variables. 0 disables the check.
+#define KK_GC_ALLOCS 100000
+#define KK_GC_ROOTS 10000
+
+#define KK_TABLE_MIN_CAP 8
+
+// default stack size in cells, can be changed with KK_STACK_SIZE. Only the
+// pages that get touched use memory.
+#define KK_STACK_SIZE (1 << 24)
+
+// slots in the line sample table and the number of files it can tell apart
+#define KK_PROF_LINES (1 << 14)
+#define KK_PROF_FILES 32
+// how many of the hottest lines are reported
+#define KK_PROF_TOP 30
+
+#define KK_OUT_SIZE (1 << 16)
+#define KK_STREAM_BUF (1 << 16)
+// how many old slots get moved to the new item array on each table access
+// while a resize is in progress.
+#define KK_TABLE_MIGRATE 16
+typedef struct _kk_heap_block {
+	struct _kk_heap_block *next;
+} kk_heap_block;
 
-#define GCOBJ(a) ((kk_gcobj *)(a).ptr_val)
-#define CONS(a) ((kk_cons *)a->ptr_val)
-#define PUSH(t, f, v) (*++stack = (kk_cell){ .type = kk_type_##t, . f##_val = v })
-#define POP() (*stack--)
-#define STACKLEN() (stack - stack_storage)
+typedef struct {
+	size_t allocs;
+	size_t live;
+	size_t live_bytes;
+	size_t peak;
+} kk_heap_type_stats_t;
+
+typedef struct {
+	size_t allocs;
+	size_t frees;
+	size_t reused;
+	size_t large;
+	size_t slabs;
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t live_objs;
+	size_t peak_objs;
+	uint64_t start_ns;
+	kk_heap_type_stats_t types[KK_TYPES];
+} kk_heap_stats_t;
+
+// With KK_HEAP_LEAKS set, every object is preceded by one of these, which
+// records where it was allocated. Live objects are kept in a list, so the
+// ones still alive at exit can be reported.
+typedef struct _kk_heap_track {
+	struct _kk_heap_track *prev;
+	struct _kk_heap_track *next;
+	const char *file;
+	int line;
+} kk_heap_track;
+
+typedef struct {
+	kk_gcobj **items;
+	int len;
+	int cap;
+} kk_gc_stack;
+
+typedef struct {
+	size_t collections;
+	size_t freed;
+	uint64_t pause_total_ns;
+	uint64_t pause_max_ns;
+} kk_gc_stats_t;
+
+// The stack is empty when stack points to stack_storage, slot 0 itself lies in
+// the lower guard page and is never read or written. The stack is surrounded
+// by inaccessible guard pages, so push and pop don't have to check bounds,
+// running off either end faults and kk_stack_fault turns that into a runtime
+// error.
+kk_cell *stack_storage = NULL;
+kk_cell *stack = NULL;
+size_t kk_stack_size = KK_STACK_SIZE;
+char *kk_stack_map = NULL;
+size_t kk_stack_map_len = 0;
+size_t kk_page_size = 0;
+// where the c stack starts and how far it may grow, deep recursion of words
+// faults below that
+char *kk_cstack_top = NULL;
+size_t kk_cstack_max = 0;
+
+kk_heap_block *kk_heap_free_lists[KK_HEAP_CLASSES] = {0};
+char *kk_heap_slab = NULL;
+size_t kk_heap_slab_left = 0;
+kk_heap_stats_t kk_heap_stats = {0};
+kk_bool kk_heap_tracking = 0;
+kk_heap_track kk_heap_tracked = { &kk_heap_tracked, &kk_heap_tracked, NULL, 0 };
+
+size_t kk_gc_max_allocs = KK_GC_ALLOCS;
+size_t kk_gc_max_roots = KK_GC_ROOTS;
+size_t kk_gc_allocs = 0;
+kk_gc_stack kk_gc_roots = {0};
+kk_gc_stack kk_gc_work = {0};
+kk_gc_stack kk_gc_black_work = {0};
+kk_gc_stack kk_gc_garbage = {0};
+kk_gc_stats_t kk_gc_stats = {0};
+
+// stdout is buffered here and flushed when full, at exit, before errors and
+// on each newline when writing to a terminal.
+char kk_out_buf[KK_OUT_SIZE];
+size_t kk_out_len = 0;
+int kk_out_tty = 0;
+
+kk_gcobj *kk_stdin = NULL;
+
+// entries of the work stack used for printing. str is written as is, cell is
+// printed if str is NULL.
+typedef struct {
+	const char *str;
+	kk_cell cell;
+} kk_put_item;
+
+kk_put_item *kk_put_stack = NULL;
+int kk_put_len = 0;
+int kk_put_cap = 0;
+
+volatile int kk_at = 0;
+const char *type_strs[] = {
+	"null", "float", "char", "gc object", "string", "cons", "array", "table", "float", "file",
+	"float array", "byte array"
+};
+
+void kk_out_flush(void) {
+	size_t off = 0;
+	while (off < kk_out_len) {
+		ssize_t n = write(STDOUT_FILENO, kk_out_buf + off, kk_out_len - off);
+		if (n <= 0)
+			break;
+		off += n;
+	}
+
+	kk_out_len = 0;
+}
+
+void kk_out_write(const char *data, size_t len) {
+	if (kk_out_len + len > KK_OUT_SIZE) {
+		kk_out_flush();
+
+		if (len > KK_OUT_SIZE) {
+			memcpy(kk_out_buf, data, KK_OUT_SIZE);
+			kk_out_len = KK_OUT_SIZE;
+			kk_out_flush();
+			kk_out_write(data + KK_OUT_SIZE, len - KK_OUT_SIZE);
+			return;
+		}
+	}
+
+	memcpy(kk_out_buf + kk_out_len, data, len);
+	kk_out_len += len;
+}
+
+#define kk_out_str(s) kk_out_write(s, sizeof(s) - 1)
+
+static inline void kk_out_char(char c) {
+	if (kk_out_len >= KK_OUT_SIZE)
+		kk_out_flush();
+
+	kk_out_buf[kk_out_len++] = c;
+}
+
+void kk_out_newline(void) {
+	kk_out_char('\n');
+	if (kk_out_tty)
+		kk_out_flush();
+}
+
+// Writes the decimal representation of v to buf, returns its length.
+int kk_fmt_int(char *buf, int64_t v) {
+	char tmp[24];
+	int n = 0;
+	uint64_t u = v < 0 ? -(uint64_t)v : (uint64_t)v;
+
+	do {
+		tmp[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+
+	int len = 0;
+	if (v < 0)
+		buf[len++] = '-';
+	while (n)
+		buf[len++] = tmp[--n];
+
+	return len;
+}
+
+// Writes f with the fewest fractional digits that still read back as f. f is
+// scaled by 10^k and rounded to an integer m, the digits of m are right when
+// m / 10^k rounds back to f, since that is also how strtod rounds them. Values outside
+// that range fall back to the shortest of %.15g, %.16g and %.17g that round
+// trips. buf needs at least 32 bytes.
+int kk_fmt_float(char *buf, kk_float f) {
+	static const kk_float pow10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8,
+		1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17 };
+	const kk_float max = 9007199254740992.0; // 2^53
+
+	if (f >= -max && f <= max && f == (kk_float)(int64_t)f)
+		return kk_fmt_int(buf, (int64_t)f);
+
+	// like %g, small values are left to the exponent notation
+	kk_float a = f < 0 ? -f : f;
+	for (int k=1; k <= 17 && a >= 1e-4 && a * pow10[k] < max; k++) {
+		kk_float m = (kk_float)(int64_t)(a * pow10[k] + 0.5);
+		if (m / pow10[k] != a)
+			continue;
+
+		int len = 0;
+		if (f < 0)
+			buf[len++] = '-';
+
+		uint64_t v = (uint64_t)m, p = (uint64_t)pow10[k];
+		len += kk_fmt_int(buf + len, v / p);
+		buf[len++] = '.';
+
+		uint64_t frac = v % p;
+		for (int i=k - 1; i >= 0; i--) {
+			buf[len + i] = '0' + frac % 10;
+			frac /= 10;
+		}
+		len += k;
+
+		while (buf[len - 1] == '0')
+			len--;
+
+		return len;
+	}
+
+	int len;
+	for (int prec = 15; prec <= 17; prec++) {
+		len = snprintf(buf, 32, "%.*g", prec, f);
+		if (strtod(buf, NULL) == f)
+			break;
+	}
+
+	return len;
+}
+
+void kk_runtime_error(char *msg, ...) {
+	kk_out_flush();
+	fprintf(stderr, "\x1b[1m(%s: %d): \x1b[31mruntime error: \x1b[0m",
+		kk_locs[kk_at].file, kk_locs[kk_at].line);
+
+	va_list args;
+	va_start(args, msg);
+	vfprintf(stderr, msg, args);
+	va_end(args);
+
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+void *memdup(void *src, size_t s) {
+	void *tgt = malloc(s);
+	memcpy(tgt, src, s);
+	return tgt;
+}
+
+void *kk_heap_alloc(size_t size) {
+	kk_heap_stats.allocs++;
+	kk_heap_stats.live_bytes += size;
+	if (kk_heap_stats.live_bytes > kk_heap_stats.peak_bytes)
+		kk_heap_stats.peak_bytes = kk_heap_stats.live_bytes;
+
+#ifndef KK_HEAP_NOPOOL
+	if (size <= KK_HEAP_MAX_POOLED) {
+		int class = (size - 1) / KK_HEAP_GRAIN;
+		size_t bsize = (class + 1) * KK_HEAP_GRAIN;
+
+		kk_heap_block *b = kk_heap_free_lists[class];
+		if (b) {
+			kk_heap_free_lists[class] = b->next;
+			kk_heap_stats.reused++;
+			return b;
+		}
+
+		if (kk_heap_slab_left < bsize) {
+			// don't waste the tail of the old slab
+			if (kk_heap_slab_left >= KK_HEAP_GRAIN) {
+				int tail = kk_heap_slab_left / KK_HEAP_GRAIN - 1;
+				b = (kk_heap_block *)kk_heap_slab;
+				b->next = kk_heap_free_lists[tail];
+				kk_heap_free_lists[tail] = b;
+			}
+
+			kk_heap_slab = malloc(KK_HEAP_SLAB);
+			if (!kk_heap_slab)
+				kk_runtime_error("Could not allocate a heap slab.");
+
+			kk_heap_slab_left = KK_HEAP_SLAB;
+			kk_heap_stats.slabs++;
+		}
+
+		b = (kk_heap_block *)kk_heap_slab;
+		kk_heap_slab += bsize;
+		kk_heap_slab_left -= bsize;
+		return b;
+	}
+#endif
+
+	kk_heap_stats.large++;
+	void *p = malloc(size);
+	if (!p)
+		kk_runtime_error("Could not allocate %zu bytes.", size);
+
+	return p;
+}
+
+void kk_heap_free(void *p, size_t size) {
+	kk_heap_stats.frees++;
+	kk_heap_stats.live_bytes -= size;
+
+#ifndef KK_HEAP_NOPOOL
+	if (size <= KK_HEAP_MAX_POOLED) {
+		int class = (size - 1) / KK_HEAP_GRAIN;
+		kk_heap_block *b = (kk_heap_block *)p;
+		b->next = kk_heap_free_lists[class];
+		kk_heap_free_lists[class] = b;
+		return;
+	}
+#endif
+
+	free(p);
+}
+
+uint64_t kk_now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+void kk_heap_report(void) {
+	double secs = (kk_now_ns() - kk_heap_stats.start_ns) / 1e9;
+	if (secs <= 0)
+		secs = 1e-9;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(stderr,
+		"kk heap: allocs=%zu frees=%zu reused=%zu large=%zu slabs=%zu "
+		"live_bytes=%zu peak_bytes=%zu live_objs=%zu peak_objs=%zu "
+		"allocs_per_s=%.0f frees_per_s=%.0f max_rss_kb=%ld\n",
+		kk_heap_stats.allocs, kk_heap_stats.frees, kk_heap_stats.reused,
+		kk_heap_stats.large, kk_heap_stats.slabs,
+		kk_heap_stats.live_bytes, kk_heap_stats.peak_bytes,
+		kk_heap_stats.live_objs, kk_heap_stats.peak_objs,
+		kk_heap_stats.allocs / secs, kk_heap_stats.frees / secs, ru.ru_maxrss);
+
+	for (int i=0; i < KK_TYPES; i++) {
+		kk_heap_type_stats_t *t = &kk_heap_stats.types[i];
+		if (t->allocs)
+			fprintf(stderr, "kk heap: type=\"%s\" allocs=%zu live=%zu live_bytes=%zu peak=%zu\n",
+				type_strs[i], t->allocs, t->live, t->live_bytes, t->peak);
+	}
+
+	fprintf(stderr,
+		"kk gc: collections=%zu freed=%zu pause_total_ns=%llu pause_max_ns=%llu\n",
+		kk_gc_stats.collections, kk_gc_stats.freed,
+		(unsigned long long)kk_gc_stats.pause_total_ns,
+		(unsigned long long)kk_gc_stats.pause_max_ns);
+}
+
+void kk_gc_collect(void);
+
+// Gives the memory of o back to the heap.
+void kk_gcobj_release(kk_gcobj *o) {
+	kk_heap_stats.live_objs--;
+	kk_heap_type_stats_t *ts = &kk_heap_stats.types[o->type];
+	ts->live--;
+	ts->live_bytes -= o->size;
+
+	if (kk_heap_tracking) {
+		kk_heap_track *t = (kk_heap_track *)o - 1;
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		kk_heap_free(t, sizeof(kk_heap_track) + o->size);
+		return;
+	}
+
+	kk_heap_free(o, o->size);
+}
+
+int kk_heap_cmp_track(const void *a, const void *b) {
+	const kk_heap_track *x = *(kk_heap_track **)a, *y = *(kk_heap_track **)b;
+	kk_type tx = ((kk_gcobj *)(x + 1))->type, ty = ((kk_gcobj *)(y + 1))->type;
+
+	if (x->file != y->file)
+		return x->file < y->file ? -1 : 1;
+	if (x->line != y->line)
+		return x->line - y->line;
+	return (int)tx - (int)ty;
+}
+
+// Freed objects still in the collector's root buffer are only freed by the
+// next collection, so they aren't counted.
+static inline kk_bool kk_heap_track_alive(kk_heap_track *t) {
+	kk_gcobj *o = (kk_gcobj *)(t + 1);
+	return !o->buffered || o->refs > 0;
+}
+
+// Lists the objects still alive, grouped by where they were allocated and
+// their type. Values held by variables at exit show up here too.
+void kk_heap_leak_report(void) {
+	size_t n = 0;
+	for (kk_heap_track *t = kk_heap_tracked.next; t != &kk_heap_tracked; t = t->next)
+		n += kk_heap_track_alive(t);
+
+	fprintf(stderr, "kk leak: %zu objects alive at exit\n", n);
+	if (!n)
+		return;
+
+	kk_heap_track **all = malloc(n * sizeof(kk_heap_track *));
+	if (!all)
+		return;
+
+	n = 0;
+	for (kk_heap_track *t = kk_heap_tracked.next; t != &kk_heap_tracked; t = t->next)
+		if (kk_heap_track_alive(t))
+			all[n++] = t;
+	qsort(all, n, sizeof(kk_heap_track *), kk_heap_cmp_track);
+
+	for (size_t i=0; i < n;) {
+		size_t j = i, bytes = 0;
+		for (; j < n && !kk_heap_cmp_track(&all[i], &all[j]); j++)
+			bytes += ((kk_gcobj *)(all[j] + 1))->size;
+
+		fprintf(stderr, "kk leak: %zu %s (%zu bytes) allocated at %s:%d\n",
+			j - i, type_strs[((kk_gcobj *)(all[i] + 1))->type], bytes,
+			all[i]->file, all[i]->line);
+		i = j;
+	}
+
+	free(all);
+}
+
+kk_gcobj *kk_gcobj_new(kk_type type, size_t payload) {
+	size_t size = sizeof(kk_gcobj) + payload;
+
+	if (kk_gc_roots.len && (
+		(kk_gc_max_allocs && ++kk_gc_allocs >= kk_gc_max_allocs) ||
+		(kk_gc_max_roots && (size_t)kk_gc_roots.len >= kk_gc_max_roots)))
+		kk_gc_collect();
+
+	kk_gcobj *o;
+	if (kk_heap_tracking) {
+		kk_heap_track *t = kk_heap_alloc(sizeof(kk_heap_track) + size);
+		t->file = kk_locs[kk_at].file;
+		t->line = kk_locs[kk_at].line;
+		t->prev = &kk_heap_tracked;
+		t->next = kk_heap_tracked.next;
+		t->next->prev = t;
+		kk_heap_tracked.next = t;
+		o = (kk_gcobj *)(t + 1);
+	} else {
+		o = kk_heap_alloc(size);
+	}
+
+	if (++kk_heap_stats.live_objs > kk_heap_stats.peak_objs)
+		kk_heap_stats.peak_objs = kk_heap_stats.live_objs;
+	kk_heap_type_stats_t *ts = &kk_heap_stats.types[type];
+	ts->allocs++;
+	ts->live_bytes += size;
+	if (++ts->live > ts->peak)
+		ts->peak = ts->live;
+
+	o->refs = 1;
+	o->type = type;
+	o->color = KK_GC_BLACK;
+	o->buffered = 0;
+	o->immortal = 0;
+	o->size = size;
+	o->ptr_val = PAYLOAD(o);
+
+	return o;
+}
+
+kk_gcobj *kk_string_new(const char *s, size_t len) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_string, sizeof(kk_string) + len + 1);
+	kk_string *str = STR(o);
+	str->len = len;
+	str->cap = len;
+	str->data = (char *)(str + 1);
+	str->base = KK_NULL;
+	memcpy(str->data, s, len);
+	str->data[len] = 0;
+
+	return o;
+}
+
+// Creates a string pointing to len bytes at data, which belong to base.
+kk_gcobj *kk_string_view(kk_gcobj *base, char *data, size_t len) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_string, sizeof(kk_string));
+	kk_string *str = STR(o);
+	str->len = len;
+	str->cap = len;
+	str->data = data;
+	str->base = kk_cell_gcobj(base);
+	kk_gcobj_inc(&str->base);
+
+	return o;
+}
+
+void kk_gcobj_dec(kk_cell *c);
+
+// Gives a string pointing into another object a copy of its data.
+void kk_string_detach(kk_string *s) {
+	char *data = malloc(s->len + 1);
+	if (!data)
+		kk_runtime_error("Could not allocate a string.");
+
+	memcpy(data, s->data, s->len);
+	data[s->len] = 0;
+	s->data = data;
+	s->cap = s->len;
+
+	kk_cell base = s->base;
+	s->base = KK_NULL;
+	kk_gcobj_dec(&base);
+}
+
+// Returns the data of s followed by a zero byte.
+const char *kk_string_cstr(kk_string *s) {
+	if (s->data[s->len] != 0)
+		kk_string_detach(s);
+
+	return s->data;
+}
+
+void kk_string_reserve(kk_string *s, size_t cap) {
+	if (!KK_IS_NULL(s->base))
+		kk_string_detach(s);
+
+	if (cap <= s->cap)
+		return;
+
+	size_t ncap = s->cap * 2;
+	if (ncap < cap)
+		ncap = cap;
+	if (ncap < 16)
+		ncap = 16;
+
+	if (s->data == (char *)(s + 1)) {
+		char *data = malloc(ncap + 1);
+		if (!data)
+			kk_runtime_error("Could not allocate a string.");
+
+		memcpy(data, s->data, s->len + 1);
+		s->data = data;
+	} else {
+		s->data = realloc(s->data, ncap + 1);
+		if (!s->data)
+			kk_runtime_error("Could not allocate a string.");
+	}
+
+	s->cap = ncap;
+}
+
+static inline size_t kk_tarray_elem(int type) {
+	return type == kk_type_farray ? sizeof(kk_float) : 1;
+}
+
+// Creates a typed array of len zeroes.
+kk_gcobj *kk_tarray_new(kk_type type, int len) {
+	size_t elem = kk_tarray_elem(type);
+	kk_gcobj *o = kk_gcobj_new(type, sizeof(kk_tarray) + len * elem);
+	kk_tarray *arr = TARRAY(o);
+	arr->len = len;
+	arr->cap = len;
+	arr->data = arr + 1;
+	arr->base = KK_NULL;
+	memset(arr->data, 0, len * elem);
+
+	return o;
+}
+
+kk_gcobj *kk_tarray_view(kk_gcobj *base) {
+	kk_gcobj *o = kk_gcobj_new(base->type, sizeof(kk_tarray));
+	kk_tarray *arr = TARRAY(o);
+	arr->len = TARRAY(base)->len;
+	arr->cap = arr->len;
+	arr->data = TARRAY(base)->data;
+	arr->base = kk_cell_gcobj(base);
+	kk_gcobj_inc(&arr->base);
+
+	return o;
+}
+
+// Gives a typed array pointing into another object its own copy of the data.
+void kk_tarray_detach(kk_gcobj *o) {
+	kk_tarray *arr = TARRAY(o);
+	size_t elem = kk_tarray_elem(o->type);
+	void *data = malloc((arr->len ? arr->len : 1) * elem);
+	if (!data)
+		kk_runtime_error("Could not allocate an array.");
+
+	memcpy(data, arr->data, arr->len * elem);
+	arr->data = data;
+	arr->cap = arr->len;
+
+	kk_cell base = arr->base;
+	arr->base = KK_NULL;
+	kk_gcobj_dec(&base);
+}
+
+// Returns the typed array in o ready for mutation.
+kk_tarray *kk_tarray_mut(kk_gcobj *o) {
+	if (!KK_IS_NULL(TARRAY(o)->base))
+		kk_tarray_detach(o);
+
+	return TARRAY(o);
+}
+
+void kk_tarray_reserve(kk_gcobj *o, int cap) {
+	kk_tarray *arr = kk_tarray_mut(o);
+	size_t elem = kk_tarray_elem(o->type);
+	if (cap <= arr->cap)
+		return;
+
+	int ncap = arr->cap * 2;
+	if (ncap < cap)
+		ncap = cap;
+	if (ncap < 16)
+		ncap = 16;
+
+	if (arr->data == (void *)(arr + 1)) {
+		void *data = malloc(ncap * elem);
+		if (!data)
+			kk_runtime_error("Could not allocate an array.");
+
+		memcpy(data, arr->data, arr->len * elem);
+		arr->data = data;
+	} else {
+		arr->data = realloc(arr->data, ncap * elem);
+		if (!arr->data)
+			kk_runtime_error("Could not allocate an array.");
+	}
+
+	arr->cap = ncap;
+}
+
+// Bulk float array kernels. The scalar versions are always there, the avx
+// ones are picked in kk_init if the cpu supports them. Sums are accumulated
+// in a different order, so the results can differ in the last bits.
+typedef enum {
+	kk_op_add,
+	kk_op_sub,
+	kk_op_mul,
+	kk_op_div,
+	kk_op_set,
+} kk_op;
+
+typedef struct {
+	kk_float (*sum)(const kk_float *a, size_t n);
+	kk_float (*dot)(const kk_float *a, const kk_float *b, size_t n);
+	kk_float (*min)(const kk_float *a, size_t n);
+	kk_float (*max)(const kk_float *a, size_t n);
+	void (*op)(kk_float *a, const kk_float *b, size_t n, kk_op op);
+	void (*op_scalar)(kk_float *a, kk_float b, size_t n, kk_op op);
+} kk_simd_t;
+
+kk_float kk_scalar_sum(const kk_float *a, size_t n) {
+	kk_float sum = 0;
+	for (size_t i=0; i < n; i++)
+		sum += a[i];
+	return sum;
+}
+
+kk_float kk_scalar_dot(const kk_float *a, const kk_float *b, size_t n) {
+	kk_float sum = 0;
+	for (size_t i=0; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+kk_float kk_scalar_min(const kk_float *a, size_t n) {
+	kk_float m = a[0];
+	for (size_t i=1; i < n; i++)
+		m = a[i] < m ? a[i] : m;
+	return m;
+}
+
+kk_float kk_scalar_max(const kk_float *a, size_t n) {
+	kk_float m = a[0];
+	for (size_t i=1; i < n; i++)
+		m = a[i] > m ? a[i] : m;
+	return m;
+}
+
+#define KK_SCALAR_OPS(b) \
+	switch (op) { \
+	case kk_op_add: for (size_t i=0; i < n; i++) a[i] += b; break; \
+	case kk_op_sub: for (size_t i=0; i < n; i++) a[i] -= b; break; \
+	case kk_op_mul: for (size_t i=0; i < n; i++) a[i] *= b; break; \
+	case kk_op_div: for (size_t i=0; i < n; i++) a[i] /= b; break; \
+	case kk_op_set: for (size_t i=0; i < n; i++) a[i] = b; break; \
+	}
+
+void kk_scalar_op(kk_float *a, const kk_float *b, size_t n, kk_op op) {
+	KK_SCALAR_OPS(b[i]);
+}
+
+void kk_scalar_op_scalar(kk_float *a, kk_float b, size_t n, kk_op op) {
+	KK_SCALAR_OPS(b);
+}
+
+kk_simd_t kk_simd = {
+	kk_scalar_sum, kk_scalar_dot, kk_scalar_min, kk_scalar_max,
+	kk_scalar_op, kk_scalar_op_scalar };
+
+#ifdef KK_SIMD_AVX
+#define KK_AVX __attribute__((target("avx")))
+
+// adds up the 4 lanes of v
+KK_AVX static inline kk_float kk_avx_hsum(__m256d v) {
+	__m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+KK_AVX kk_float kk_avx_sum(const kk_float *a, size_t n) {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_loadu_pd(a + i));
+		s1 = _mm256_add_pd(s1, _mm256_loadu_pd(a + i + 4));
+	}
+
+	kk_float sum = kk_avx_hsum(_mm256_add_pd(s0, s1));
+	for (; i < n; i++)
+		sum += a[i];
+	return sum;
+}
+
+KK_AVX kk_float kk_avx_dot(const kk_float *a, const kk_float *b, size_t n) {
+	__m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+		s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4)));
+	}
+
+	kk_float sum = kk_avx_hsum(_mm256_add_pd(s0, s1));
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+#define KK_AVX_MINMAX(name, vop, cmp) \
+KK_AVX kk_float name(const kk_float *a, size_t n) { \
+	size_t i = 0; \
+	kk_float m = a[0]; \
+	if (n >= 4) { \
+		__m256d v = _mm256_loadu_pd(a); \
+		for (i = 4; i + 4 <= n; i += 4) \
+			v = vop(v, _mm256_loadu_pd(a + i)); \
+		kk_float t[4]; \
+		_mm256_storeu_pd(t, v); \
+		m = t[0]; \
+		for (int j=1; j < 4; j++) \
+			m = t[j] cmp m ? t[j] : m; \
+	} \
+	for (; i < n; i++) \
+		m = a[i] cmp m ? a[i] : m; \
+	return m; \
+}
+
+KK_AVX_MINMAX(kk_avx_min, _mm256_min_pd, <)
+KK_AVX_MINMAX(kk_avx_max, _mm256_max_pd, >)
+
+// vb is the vector of the second operand at a + i, b its scalar at i.
+#define KK_AVX_OPS(vb, b) \
+	size_t i = 0; \
+	switch (op) { \
+	case kk_op_add: \
+		for (; i + 4 <= n; i += 4) \
+			_mm256_storeu_pd(a + i, _mm256_add_pd(_mm256_loadu_pd(a + i), vb)); \
+		for (; i < n; i++) a[i] += b; \
+		break; \
+	case kk_op_sub: \
+		for (; i + 4 <= n; i += 4) \
+			_mm256_storeu_pd(a + i, _mm256_sub_pd(_mm256_loadu_pd(a + i), vb)); \
+		for (; i < n; i++) a[i] -= b; \
+		break; \
+	case kk_op_mul: \
+		for (; i + 4 <= n; i += 4) \
+			_mm256_storeu_pd(a + i, _mm256_mul_pd(_mm256_loadu_pd(a + i), vb)); \
+		for (; i < n; i++) a[i] *= b; \
+		break; \
+	case kk_op_div: \
+		for (; i + 4 <= n; i += 4) \
+			_mm256_storeu_pd(a + i, _mm256_div_pd(_mm256_loadu_pd(a + i), vb)); \
+		for (; i < n; i++) a[i] /= b; \
+		break; \
+	case kk_op_set: \
+		for (; i + 4 <= n; i += 4) \
+			_mm256_storeu_pd(a + i, vb); \
+		for (; i < n; i++) a[i] = b; \
+		break; \
+	}
+
+KK_AVX void kk_avx_op(kk_float *a, const kk_float *b, size_t n, kk_op op) {
+	KK_AVX_OPS(_mm256_loadu_pd(b + i), b[i]);
+}
+
+KK_AVX void kk_avx_op_scalar(kk_float *a, kk_float b, size_t n, kk_op op) {
+	__m256d vb = _mm256_set1_pd(b);
+	KK_AVX_OPS(vb, b);
+}
+#endif
+
+// Returns the string in c ready for mutation, replacing immortal strings with
+// a copy.
+kk_string *kk_string_mut(kk_cell *c) {
+	kk_gcobj *o = GCOBJ(*c);
+	if (o->immortal)
+		*c = kk_cell_gcobj(kk_string_new(STR(o)->data, STR(o)->len));
+	else if (!KK_IS_NULL(STR(o)->base))
+		kk_string_detach(STR(o));
+
+	return STR(GCOBJ(*c));
+}
+
+// data can point into s itself, it is found again after s grows.
+void kk_string_append(kk_string *s, const char *data, size_t len) {
+	if (data >= s->data && data < s->data + s->len) {
+		size_t off = data - s->data;
+		kk_string_reserve(s, s->len + len);
+		data = s->data + off;
+	} else {
+		kk_string_reserve(s, s->len + len);
+	}
+
+	memcpy(s->data + s->len, data, len);
+	s->len += len;
+	s->data[s->len] = 0;
+}
+
+kk_gcobj *kk_array_new(int len) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_array, sizeof(kk_array) + len * sizeof(kk_cell));
+	kk_array *arr = (kk_array *)o->ptr_val;
+	arr->len = len;
+	arr->cap = len;
+	arr->data = (kk_cell *)(arr + 1);
+	arr->base = KK_NULL;
+	for (int i=0; i < len; i++)
+		arr->data[i] = KK_NULL;
+
+	return o;
+}
+
+kk_gcobj *kk_array_view(kk_gcobj *base, kk_cell *data, int len) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_array, sizeof(kk_array));
+	kk_array *arr = (kk_array *)o->ptr_val;
+	arr->len = len;
+	arr->cap = len;
+	arr->data = data;
+	arr->base = kk_cell_gcobj(base);
+	kk_gcobj_inc(&arr->base);
+
+	return o;
+}
+
+void kk_cell_copy(kk_cell *target, kk_cell *src);
+
+// Gives an array pointing into another object its own copy of the cells.
+void kk_array_detach(kk_array *arr) {
+	kk_cell *data = malloc((arr->len ? arr->len : 1) * sizeof(kk_cell));
+	if (!data)
+		kk_runtime_error("Could not allocate an array.");
+
+	memcpy(data, arr->data, arr->len * sizeof(kk_cell));
+	for (int i=0; i < arr->len; i++)
+		kk_gcobj_inc(&data[i]);
+	arr->data = data;
+	arr->cap = arr->len;
+
+	kk_cell base = arr->base;
+	arr->base = KK_NULL;
+	kk_gcobj_dec(&base);
+}
+
+// Returns the array in o ready for mutation.
+kk_array *kk_array_mut(kk_gcobj *o) {
+	kk_array *arr = (kk_array *)o->ptr_val;
+	if (!KK_IS_NULL(arr->base))
+		kk_array_detach(arr);
+
+	return arr;
+}
+
+// Returns an object owning the data of the string or array o, that views of
+// it can use as their base. Unless o already has one, its data is moved to a
+// new hidden object, which becomes the base of o too. Big data already lives
+// outside of o and is handed over without copying.
+kk_gcobj *kk_share(kk_gcobj *o) {
+	if (o->immortal)
+		return o;
+
+	if (KK_IS_TARRAY(o->type)) {
+		kk_tarray *arr = TARRAY(o);
+		if (KK_IS_NULL(arr->base)) {
+			kk_gcobj *b;
+			if (arr->data == (void *)(arr + 1)) {
+				b = kk_tarray_new(o->type, arr->len);
+				memcpy(TARRAY(b)->data, arr->data, arr->len * kk_tarray_elem(o->type));
+			} else {
+				b = kk_gcobj_new(o->type, sizeof(kk_tarray));
+				*TARRAY(b) = *arr;
+			}
+
+			arr->data = TARRAY(b)->data;
+			arr->cap = arr->len;
+			arr->base = kk_cell_gcobj(b);
+		}
+
+		return GCOBJ(arr->base);
+	}
+
+	if (o->type == kk_type_string) {
+		kk_string *s = STR(o);
+		if (KK_IS_NULL(s->base)) {
+			kk_gcobj *b;
+			if (s->data == (char *)(s + 1)) {
+				b = kk_string_new(s->data, s->len);
+			} else {
+				b = kk_gcobj_new(kk_type_string, sizeof(kk_string));
+				*STR(b) = *s;
+			}
+
+			s->data = STR(b)->data;
+			s->cap = s->len;
+			s->base = kk_cell_gcobj(b);
+		}
+
+		return GCOBJ(s->base);
+	}
+
+	kk_array *arr = (kk_array *)o->ptr_val;
+	if (KK_IS_NULL(arr->base)) {
+		kk_gcobj *b;
+		if (arr->data == (kk_cell *)(arr + 1)) {
+			b = kk_array_new(arr->len);
+			memcpy(((kk_array *)b->ptr_val)->data, arr->data, arr->len * sizeof(kk_cell));
+		} else {
+			b = kk_gcobj_new(kk_type_array, sizeof(kk_array));
+			*(kk_array *)b->ptr_val = *arr;
+		}
+
+		arr->data = ((kk_array *)b->ptr_val)->data;
+		arr->cap = arr->len;
+		arr->base = kk_cell_gcobj(b);
+	}
+
+	return GCOBJ(arr->base);
+}
+
+void kk_array_reserve(kk_array *arr, int cap) {
+	if (!KK_IS_NULL(arr->base))
+		kk_array_detach(arr);
+
+	if (cap <= arr->cap)
+		return;
+
+	int ncap = arr->cap * 2;
+	if (ncap < cap)
+		ncap = cap;
+	if (ncap < 8)
+		ncap = 8;
+
+	if (arr->data == (kk_cell *)(arr + 1)) {
+		kk_cell *data = malloc(ncap * sizeof(kk_cell));
+		if (!data)
+			kk_runtime_error("Could not allocate an array.");
+
+		memcpy(data, arr->data, arr->len * sizeof(kk_cell));
+		arr->data = data;
+	} else {
+		arr->data = realloc(arr->data, ncap * sizeof(kk_cell));
+		if (!arr->data)
+			kk_runtime_error("Could not allocate an array.");
+	}
+
+	arr->cap = ncap;
+}
+
+// Only async-signal-safe calls from here on: the fault can hit in the middle
+// of malloc or stdio, so the message is put together by hand and written
+// straight to stderr.
+void kk_fault_write(const char *s) {
+	size_t len = strlen(s);
+	while (len > 0) {
+		ssize_t n = write(STDERR_FILENO, s, len);
+		if (n <= 0)
+			return;
+		s += n;
+		len -= n;
+	}
+}
+
+void kk_fault_error(const char *msg, const char *num, const char *rest) {
+	char line[32];
+
+	kk_out_flush();
+	kk_fault_write("\x1b[1m(");
+	kk_fault_write(kk_locs[kk_at].file);
+	kk_fault_write(": ");
+	line[kk_fmt_int(line, kk_locs[kk_at].line)] = '\0';
+	kk_fault_write(line);
+	kk_fault_write("): \x1b[31mruntime error: \x1b[0m");
+	kk_fault_write(msg);
+	kk_fault_write(num);
+	kk_fault_write(rest);
+	kk_fault_write("\n");
+	_exit(1);
+}
+
+void kk_stack_fault(int sig, siginfo_t *info, void *ctx) {
+	(void)sig;
+	(void)ctx;
+	char *addr = info->si_addr;
+	char *low = kk_stack_map, *high = kk_stack_map + kk_stack_map_len - kk_page_size;
+
+	if (addr >= low && addr < low + kk_page_size)
+		kk_fault_error("Stack underflow.", "", "");
+
+	if (addr >= high && addr < high + kk_page_size) {
+		char num[32];
+		num[kk_fmt_int(num, (int64_t)kk_stack_size)] = '\0';
+		kk_fault_error("Stack overflow, the stack can hold ", num,
+			" values (see KK_STACK_SIZE).");
+	}
+
+	// frames can be big, so the fault can land a bit further below the limit
+	if (kk_cstack_max && addr < kk_cstack_top &&
+		(size_t)(kk_cstack_top - addr) < kk_cstack_max + (1 << 20))
+		kk_fault_error("Recursion too deep, the c stack is full.", "", "");
+
+	// not ours, let it crash as usual once the handler returns
+	signal(SIGSEGV, SIG_DFL);
+}
+
+void kk_stack_init(void) {
+	if (getenv("KK_STACK_SIZE"))
+		kk_stack_size = atol(getenv("KK_STACK_SIZE"));
+	if (kk_stack_size < 1)
+		kk_stack_size = 1;
+
+	kk_page_size = sysconf(_SC_PAGESIZE);
+	size_t len = ((kk_stack_size + 1) * sizeof(kk_cell) + kk_page_size - 1)
+		/ kk_page_size * kk_page_size;
+
+	// slot 1 starts right after the lower guard page, so slot 0 is the last
+	// cell of the guard page and touching it (popping an empty stack) faults
+	// right away. The upper guard page follows the stack.
+	kk_stack_map_len = len + 2 * kk_page_size;
+	kk_stack_map = mmap(NULL, kk_stack_map_len, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (kk_stack_map == MAP_FAILED ||
+		mprotect(kk_stack_map + kk_page_size, len, PROT_READ | PROT_WRITE))
+		kk_runtime_error("Could not allocate the stack.");
+
+	stack_storage = (kk_cell *)(kk_stack_map + kk_page_size) - 1;
+	stack = stack_storage;
+
+	char top;
+	struct rlimit rl;
+	kk_cstack_top = &top;
+	if (!getrlimit(RLIMIT_STACK, &rl) && rl.rlim_cur != RLIM_INFINITY)
+		kk_cstack_max = rl.rlim_cur;
+
+	// the handler runs on its own stack, since the fault can also come from
+	// overflowing the c stack.
+	static char sigstack[1 << 16];
+	stack_t ss = { .ss_sp = sigstack, .ss_size = sizeof(sigstack) };
+	sigaltstack(&ss, NULL);
+
+	struct sigaction sa = {0};
+	sa.sa_sigaction = kk_stack_fault;
+	sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, NULL);
+}
+
+// The profiler. Programs compiled with `-p` call kk_prof_enter at the start of
+// every word and kk_prof_leave at its end. A shadow stack of frames is used to
+// split the time into self time and time spent in callees. Setting KK_PROF to
+// a frequency also samples the source location that many times per second
+// of cpu time. Programs compiled with `-p` update it on every line.
+typedef struct {
+	int word;
+	uint64_t start;
+	uint64_t child_ns;
+} kk_prof_frame;
+
+typedef struct {
+	uint64_t calls;
+	uint64_t self_ns;
+	uint64_t total_ns;
+	// frames of the word on the shadow stack, only the outermost one adds
+	// to total_ns, so recursion isn't counted twice.
+	int active;
+} kk_prof_word;
+
+// caller is -1 for calls from the top level
+typedef struct {
+	int caller;
+	int callee;
+	uint64_t calls;
+} kk_prof_edge;
+
+typedef struct {
+	int file;
+	int line;
+	uint64_t count;
+} kk_prof_line;
+
+const char **kk_prof_names = NULL;
+int kk_prof_nwords = 0;
+kk_prof_word *kk_prof_words = NULL;
+kk_prof_frame *kk_prof_stack = NULL;
+int kk_prof_depth = 0;
+int kk_prof_cap = 0;
+kk_prof_edge *kk_prof_edges = NULL;
+int kk_prof_edges_len = 0;
+int kk_prof_edges_cap = 0;
+
+kk_prof_line kk_prof_lines[KK_PROF_LINES];
+char kk_prof_files[KK_PROF_FILES][256];
+int kk_prof_nfiles = 0;
+kk_bool kk_prof_sampling = 0;
+uint64_t kk_prof_samples = 0;
+uint64_t kk_prof_dropped = 0;
+
+kk_prof_edge *kk_prof_edge_slot(kk_prof_edge *edges, int cap, int caller, int callee) {
+	uint32_t h = (uint32_t)(caller + 1) * 2654435761u ^ (uint32_t)callee * 40503u;
+	for (int i = h & (cap - 1);; i = (i + 1) & (cap - 1))
+		if (!edges[i].calls || (edges[i].caller == caller && edges[i].callee == callee))
+			return &edges[i];
+}
+
+void kk_prof_edge_add(int caller, int callee) {
+	if (kk_prof_edges_len * 2 >= kk_prof_edges_cap) {
+		int ncap = kk_prof_edges_cap ? kk_prof_edges_cap * 2 : 64;
+		kk_prof_edge *edges = calloc(ncap, sizeof(kk_prof_edge));
+		if (!edges)
+			kk_runtime_error("Could not allocate memory for the profiler.");
+
+		for (int i=0; i < kk_prof_edges_cap; i++)
+			if (kk_prof_edges[i].calls)
+				*kk_prof_edge_slot(edges, ncap, kk_prof_edges[i].caller, kk_prof_edges[i].callee) =
+					kk_prof_edges[i];
+
+		free(kk_prof_edges);
+		kk_prof_edges = edges;
+		kk_prof_edges_cap = ncap;
+	}
+
+	kk_prof_edge *e = kk_prof_edge_slot(kk_prof_edges, kk_prof_edges_cap, caller, callee);
+	if (!e->calls) {
+		e->caller = caller;
+		e->callee = callee;
+		kk_prof_edges_len++;
+	}
+	e->calls++;
+}
+
+void kk_prof_enter(int word) {
+	if (kk_prof_depth >= kk_prof_cap) {
+		kk_prof_cap = kk_prof_cap ? kk_prof_cap * 2 : 256;
+		kk_prof_stack = realloc(kk_prof_stack, kk_prof_cap * sizeof(kk_prof_frame));
+		if (!kk_prof_stack)
+			kk_runtime_error("Could not allocate memory for the profiler.");
+	}
+
+	kk_prof_edge_add(kk_prof_depth ? kk_prof_stack[kk_prof_depth - 1].word : -1, word);
+	kk_prof_words[word].calls++;
+	kk_prof_words[word].active++;
+	kk_prof_stack[kk_prof_depth++] = (kk_prof_frame){ word, kk_now_ns(), 0 };
+}
+
+void kk_prof_leave(void) {
+	kk_prof_frame *f = &kk_prof_stack[--kk_prof_depth];
+	uint64_t elapsed = kk_now_ns() - f->start;
+	kk_prof_word *w = &kk_prof_words[f->word];
+
+	w->self_ns += elapsed - f->child_ns;
+	if (--w->active == 0)
+		w->total_ns += elapsed;
+	if (kk_prof_depth)
+		kk_prof_stack[kk_prof_depth - 1].child_ns += elapsed;
+}
+
+// Runs on SIGPROF. It doesn't allocate, lines that don't fit in the table are
+// only counted as dropped.
+void kk_prof_sample(int sig) {
+	(void)sig;
+	kk_prof_samples++;
+
+	const kk_loc *loc = &kk_locs[kk_at];
+	int file = 0;
+	while (file < kk_prof_nfiles && strncmp(kk_prof_files[file], loc->file, 255))
+		file++;
+	if (file == kk_prof_nfiles) {
+		if (file == KK_PROF_FILES) {
+			kk_prof_dropped++;
+			return;
+		}
+
+		strncpy(kk_prof_files[file], loc->file, 255);
+		kk_prof_nfiles++;
+	}
+
+	uint32_t h = (uint32_t)loc->line * 2654435761u ^ file;
+	for (int n=0; n < KK_PROF_LINES; n++) {
+		kk_prof_line *l = &kk_prof_lines[(h + n) & (KK_PROF_LINES - 1)];
+		if (l->count && (l->file != file || l->line != loc->line))
+			continue;
+
+		l->file = file;
+		l->line = loc->line;
+		l->count++;
+		return;
+	}
+
+	kk_prof_dropped++;
+}
+
+int kk_prof_cmp_words(const void *a, const void *b) {
+	uint64_t x = kk_prof_words[*(int *)a].self_ns, y = kk_prof_words[*(int *)b].self_ns;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int kk_prof_cmp_edges(const void *a, const void *b) {
+	uint64_t x = ((kk_prof_edge *)a)->calls, y = ((kk_prof_edge *)b)->calls;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int kk_prof_cmp_lines(const void *a, const void *b) {
+	uint64_t x = ((kk_prof_line *)a)->count, y = ((kk_prof_line *)b)->count;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+void kk_prof_report(void) {
+	// no more samples while the tables are sorted
+	signal(SIGPROF, SIG_IGN);
+
+	if (kk_prof_words) {
+		int *order = malloc((kk_prof_nwords + 1) * sizeof(int));
+		for (int i=0; i < kk_prof_nwords; i++)
+			order[i] = i;
+		qsort(order, kk_prof_nwords, sizeof(int), kk_prof_cmp_words);
+
+		fprintf(stderr, "kk prof: %12s %12s %12s  word\n", "calls", "self_ms", "total_ms");
+		for (int i=0; i < kk_prof_nwords; i++) {
+			kk_prof_word *w = &kk_prof_words[order[i]];
+			if (w->calls)
+				fprintf(stderr, "kk prof: %12llu %12.3f %12.3f  %s\n",
+					(unsigned long long)w->calls, w->self_ns / 1e6, w->total_ns / 1e6,
+					kk_prof_names[order[i]]);
+		}
+		free(order);
+
+		int n = 0;
+		for (int i=0; i < kk_prof_edges_cap; i++)
+			if (kk_prof_edges[i].calls)
+				kk_prof_edges[n++] = kk_prof_edges[i];
+		qsort(kk_prof_edges, n, sizeof(kk_prof_edge), kk_prof_cmp_edges);
+
+		fprintf(stderr, "kk prof: %12s  caller -> callee\n", "calls");
+		for (int i=0; i < n; i++)
+			fprintf(stderr, "kk prof: %12llu  %s -> %s\n", (unsigned long long)kk_prof_edges[i].calls,
+				kk_prof_edges[i].caller < 0 ? "main" : kk_prof_names[kk_prof_edges[i].caller],
+				kk_prof_names[kk_prof_edges[i].callee]);
+	}
+
+	if (kk_prof_samples) {
+		qsort(kk_prof_lines, KK_PROF_LINES, sizeof(kk_prof_line), kk_prof_cmp_lines);
+
+		fprintf(stderr, "kk prof: %llu samples, %llu dropped\n",
+			(unsigned long long)kk_prof_samples, (unsigned long long)kk_prof_dropped);
+		for (int i=0; i < KK_PROF_TOP && kk_prof_lines[i].count; i++)
+			fprintf(stderr, "kk prof: %12llu %11.1f%%  %s:%d\n",
+				(unsigned long long)kk_prof_lines[i].count,
+				100.0 * kk_prof_lines[i].count / kk_prof_samples,
+				kk_prof_files[kk_prof_lines[i].file], kk_prof_lines[i].line);
+	}
+}
+
+void kk_prof_init(const char **names, int nwords) {
+	kk_prof_names = names;
+	kk_prof_nwords = nwords;
+	kk_prof_words = calloc(nwords + 1, sizeof(kk_prof_word));
+	if (!kk_prof_words)
+		kk_runtime_error("Could not allocate memory for the profiler.");
+
+	// the sampler already registered the report
+	if (!kk_prof_sampling)
+		atexit(kk_prof_report);
+}
+
+void kk_prof_start_sampling(int hz) {
+	struct sigaction sa = {0};
+	sa.sa_handler = kk_prof_sample;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPROF, &sa, NULL);
+
+	long us = 1000000 / hz;
+	if (us < 1)
+		us = 1;
+
+	struct itimerval t = {0};
+	t.it_interval.tv_sec = us / 1000000;
+	t.it_interval.tv_usec = us % 1000000;
+	t.it_value = t.it_interval;
+	setitimer(ITIMER_PROF, &t, NULL);
+
+	kk_prof_sampling = 1;
+	atexit(kk_prof_report);
+}
+
+void kk_init(void) {
+	kk_out_tty = isatty(STDOUT_FILENO);
+	atexit(kk_out_flush);
+
+	kk_stack_init();
+
+#ifdef KK_SIMD_AVX
+	// KK_SIMD=0 forces the scalar kernels
+	if (__builtin_cpu_supports("avx") && !(getenv("KK_SIMD") && !atoi(getenv("KK_SIMD"))))
+		kk_simd = (kk_simd_t){
+			kk_avx_sum, kk_avx_dot, kk_avx_min, kk_avx_max,
+			kk_avx_op, kk_avx_op_scalar };
+#endif
+
+	kk_heap_stats.start_ns = kk_now_ns();
+	if (getenv("KK_HEAP_STATS"))
+		atexit(kk_heap_report);
+	if (getenv("KK_HEAP_LEAKS")) {
+		kk_heap_tracking = 1;
+		atexit(kk_heap_leak_report);
+	}
+
+	if (getenv("KK_GC_ALLOCS"))
+		kk_gc_max_allocs = atol(getenv("KK_GC_ALLOCS"));
+	if (getenv("KK_GC_ROOTS"))
+		kk_gc_max_roots = atol(getenv("KK_GC_ROOTS"));
+
+	if (getenv("KK_PROF") && atoi(getenv("KK_PROF")) > 0)
+		kk_prof_start_sampling(atoi(getenv("KK_PROF")));
+}
+
+// Calls fn on every cell o holds a reference to.
+void kk_gcobj_children(kk_gcobj *o, void (*fn)(kk_cell *)) {
+	switch (o->type) {
+	case kk_type_string:
+		fn(&STR(o)->base);
+		break;
+
+	case kk_type_cons:
+		fn(&CONS(o)->car);
+		fn(&CONS(o)->cdr);
+		break;
+
+	case kk_type_array:;
+		kk_array *arr = (kk_array *)o->ptr_val;
+		if (!KK_IS_NULL(arr->base)) {
+			fn(&arr->base);
+			break;
+		}
+
+		for (int i=0; i < arr->len; i++)
+			fn(&arr->data[i]);
+		break;
+
+	case kk_type_table:;
+		kk_table *t = TABLE(o);
+		for (int i=0; i < t->cap; i++) {
+			if (t->items[i].hash) {
+				fn(&t->items[i].key);
+				fn(&t->items[i].val);
+			}
+		}
+
+		for (int i=t->old_pos; i < t->old_cap; i++) {
+			if (t->old[i].hash) {
+				fn(&t->old[i].key);
+				fn(&t->old[i].val);
+			}
+		}
+		break;
+
+	case kk_type_farray:
+	case kk_type_barray:
+		fn(&TARRAY(o)->base);
+		break;
+	}
+}
+
+// Frees the memory owned by o, but leaves its children alone. Objects still
+// in the collector's root buffer are only marked and freed by the collector.
+void kk_gcobj_free_storage(kk_gcobj *o) {
+	switch (o->type) {
+	case kk_type_array:;
+		kk_array *arr = (kk_array *)o->ptr_val;
+		if (arr->data != (kk_cell *)(arr + 1) && KK_IS_NULL(arr->base))
+			free(arr->data);
+		break;
+
+	case kk_type_string:
+		if (STR(o)->data != (char *)(STR(o) + 1) && KK_IS_NULL(STR(o)->base))
+			free(STR(o)->data);
+		break;
+
+	case kk_type_table:
+		free(TABLE(o)->items);
+		free(TABLE(o)->old);
+		break;
+
+	case kk_type_farray:
+	case kk_type_barray:
+		if (TARRAY(o)->data != (void *)(TARRAY(o) + 1) && KK_IS_NULL(TARRAY(o)->base))
+			free(TARRAY(o)->data);
+		break;
+
+	case kk_type_file:;
+		kk_stream *f = STREAM(o);
+		free(f->buf);
+		if (f->map)
+			munmap(f->map, f->map_len);
+		if (f->owned)
+			close(f->fd);
+		break;
+	}
+
+	if (o->buffered)
+		o->color = KK_GC_BLACK;
+	else
+		kk_gcobj_release(o);
+}
+
+void kk_gcobj_dec(kk_cell *c);
+void kk_gcobj_free(kk_gcobj *o) {
+	if (o->type == kk_type_cons) {
+		kk_cons *cons = (kk_cons *)o->ptr_val;
+		kk_gcobj_dec(&cons->car);
+
+		// walk the cdr chain iteratively, so freeing a long list doesn't
+		// recurse once per node.
+		kk_cell next = cons->cdr;
+		kk_gcobj_free_storage(o);
+
+		while (kk_cell_abstype(next) == kk_type_cons && GCOBJ(next)->refs <= 1) {
+			o = GCOBJ(next);
+			o->refs = 0;
+			cons = (kk_cons *)o->ptr_val;
+			kk_gcobj_dec(&cons->car);
+			next = cons->cdr;
+			kk_gcobj_free_storage(o);
+		}
+
+		kk_gcobj_dec(&next);
+		return;
+	}
+
+	kk_gcobj_children(o, kk_gcobj_dec);
+	kk_gcobj_free_storage(o);
+}
+
+void kk_gc_push(kk_gc_stack *s, kk_gcobj *o) {
+	if (s->len >= s->cap) {
+		s->cap = s->cap ? s->cap * 2 : 256;
+		s->items = realloc(s->items, s->cap * sizeof(kk_gcobj *));
+		if (!s->items)
+			kk_runtime_error("Could not allocate the cycle collector's buffers.");
+	}
+
+	s->items[s->len++] = o;
+}
+
+void kk_gc_possible_root(kk_gcobj *o) {
+	o->color = KK_GC_PURPLE;
+
+	if (!o->buffered) {
+		o->buffered = 1;
+		kk_gc_push(&kk_gc_roots, o);
+	}
+}
 
-typedef double kk_float;
-typedef char kk_char;
-typedef char kk_bool;
+void kk_gcobj_dec(kk_cell *c) {
+	if (!KK_IS_COUNTED(*c))
+		return;
 
-typedef enum {
-	kk_type_null,
-	kk_type_float,
-	kk_type_char,
-	kk_type_gcobj,
+	kk_gcobj *o = GCOBJ(*c);
 
-	kk_type_string,
-	kk_type_cons,
-	kk_type_array,
-} kk_type;
+	if (--o->refs <= 0)
+		kk_gcobj_free(o);
+	else if (o->color != KK_GC_PURPLE && KK_GC_TRACED(o->type))
+		kk_gc_possible_root(o);
+}
 
-typedef struct {
-	kk_type type;
-	union {
-		kk_float float_val;
-		void     *ptr_val;
-		kk_char  char_val;
-	};
-} kk_cell;
+// The cycle collector is the synchronous trial deletion from Bacon and
+// Rajan's "Concurrent Cycle Collection in Reference Counted Systems". Objects
+// whose count dropped, but not to zero, are buffered as possible roots. A
+// collection subtracts the references internal to the graphs under the roots,
+// and whatever ends up with no references left is garbage. The traversals use
+// explicit work stacks, so long lists don't overflow the c stack.
 
-typedef struct {
-	short refs;
-	kk_type type;
-	void *ptr_val;
-} kk_gcobj;
+void kk_gc_mark_gray_child(kk_cell *c) {
+	if (!KK_IS_COUNTED(*c))
+		return;
 
-typedef struct {
-	int len;
-	kk_cell *data;
-} kk_array;
+	GCOBJ(*c)->refs--;
+	kk_gc_push(&kk_gc_work, GCOBJ(*c));
+}
 
-typedef struct _kk_node {
-	struct _kk_node *next;
-	kk_cell cell;
-} kk_node;
+void kk_gc_mark_gray(kk_gcobj *o) {
+	kk_gc_push(&kk_gc_work, o);
 
-typedef struct {
-	kk_cell car;
-	kk_cell cdr;
-} kk_cons;
+	while (kk_gc_work.len) {
+		o = kk_gc_work.items[--kk_gc_work.len];
+		if (o->color == KK_GC_GRAY)
+			continue;
 
-typedef struct {
-	char *name;
-	kk_cell cell;
-} kk_table_item;
+		o->color = KK_GC_GRAY;
+		kk_gcobj_children(o, kk_gc_mark_gray_child);
+	}
+}
 
-typedef struct {
-	int size;
-	kk_table_item *items;
-} kk_table;
+void kk_gc_scan_black_child(kk_cell *c) {
+	if (!KK_IS_COUNTED(*c))
+		return;
 
-kk_cell stack_storage[1<<16] = {0};
-kk_cell *stack = stack_storage;
-kk_cell tmp_cell = {0};
-kk_bool tmp_res = 0;
+	GCOBJ(*c)->refs++;
+	if (GCOBJ(*c)->color != KK_GC_BLACK)
+		kk_gc_push(&kk_gc_black_work, GCOBJ(*c));
+}
 
-int kk_line = 0;
-char kk_file[2048] = {0};
-const char *type_strs[] = {
-	"null", "float", "gc object", "char", "string", "cons", "array"
-};
+void kk_gc_scan_black(kk_gcobj *o) {
+	kk_gc_push(&kk_gc_black_work, o);
 
-void kk_runtime_error(char *msg, ...) {
-	fprintf(stderr, "\x1b[1m(%s: %d): \x1b[31mruntime error: \x1b[0m", kk_file, kk_line);
+	while (kk_gc_black_work.len) {
+		o = kk_gc_black_work.items[--kk_gc_black_work.len];
+		if (o->color == KK_GC_BLACK)
+			continue;
 
-	va_list args;
-	va_start(args, msg);
-	vfprintf(stderr, msg, args);
-	va_end(args);
+		o->color = KK_GC_BLACK;
+		kk_gcobj_children(o, kk_gc_scan_black_child);
+	}
+}
 
-	fprintf(stderr, "\n");
-	exit(1);
+void kk_gc_push_child(kk_cell *c) {
+	if (KK_IS_COUNTED(*c))
+		kk_gc_push(&kk_gc_work, GCOBJ(*c));
 }
 
-void *memdup(void *src, size_t s) {
-	void *tgt = malloc(s);
-	memcpy(tgt, src, s);
-	return tgt;
+void kk_gc_scan(kk_gcobj *o) {
+	kk_gc_push(&kk_gc_work, o);
+
+	while (kk_gc_work.len) {
+		o = kk_gc_work.items[--kk_gc_work.len];
+		if (o->color != KK_GC_GRAY)
+			continue;
+
+		if (o->refs > 0) {
+			kk_gc_scan_black(o);
+		} else {
+			o->color = KK_GC_WHITE;
+			kk_gcobj_children(o, kk_gc_push_child);
+		}
+	}
 }
 
-void kk_gcobj_inc(kk_cell *cell) {
-	if (cell->type != kk_type_gcobj)
-		return;
+// Gathers the white objects reachable from o into kk_gc_garbage. They are only
+// freed after the whole traversal, since the work stack can still point at
+// members of the cycle.
+void kk_gc_collect_white(kk_gcobj *o) {
+	kk_gc_push(&kk_gc_work, o);
 
-	kk_gcobj *o = ((kk_gcobj *)cell->ptr_val);
+	while (kk_gc_work.len) {
+		o = kk_gc_work.items[--kk_gc_work.len];
+		if (o->color != KK_GC_WHITE || o->buffered)
+			continue;
 
-	switch (o->type) {
-	case kk_type_cons:
-		kk_gcobj_inc(&((kk_cons *)o->ptr_val)->car);
-		kk_gcobj_inc(&((kk_cons *)o->ptr_val)->cdr);
+		o->color = KK_GC_BLACK;
+		kk_gcobj_children(o, kk_gc_push_child);
+		kk_gc_push(&kk_gc_garbage, o);
+	}
+}
+
+void kk_gc_collect(void) {
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int n = 0;
+	for (int i=0; i < kk_gc_roots.len; i++) {
+		kk_gcobj *o = kk_gc_roots.items[i];
+
+		if (o->color == KK_GC_PURPLE && o->refs > 0) {
+			kk_gc_mark_gray(o);
+			kk_gc_roots.items[n++] = o;
+			continue;
+		}
+
+		o->buffered = 0;
+		if (o->color == KK_GC_BLACK && o->refs <= 0)
+			kk_gcobj_release(o);
+	}
+	kk_gc_roots.len = n;
+
+	for (int i=0; i < kk_gc_roots.len; i++)
+		kk_gc_scan(kk_gc_roots.items[i]);
+
+	for (int i=0; i < kk_gc_roots.len; i++) {
+		kk_gc_roots.items[i]->buffered = 0;
+		kk_gc_collect_white(kk_gc_roots.items[i]);
+	}
+
+	for (int i=0; i < kk_gc_garbage.len; i++)
+		kk_gcobj_free_storage(kk_gc_garbage.items[i]);
+	kk_gc_stats.freed += kk_gc_garbage.len;
+	kk_gc_garbage.len = 0;
+	kk_gc_roots.len = 0;
+	kk_gc_allocs = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	uint64_t pause = (end.tv_sec - start.tv_sec) * 1000000000ull + end.tv_nsec - start.tv_nsec;
+	kk_gc_stats.collections++;
+	kk_gc_stats.pause_total_ns += pause;
+	if (pause > kk_gc_stats.pause_max_ns)
+		kk_gc_stats.pause_max_ns = pause;
+}
+
+uint32_t kk_hash_bytes(const char *p, size_t len) {
+	// fnv-1a
+	uint32_t h = 2166136261u;
+	for (size_t i=0; i < len; i++) {
+		h ^= (unsigned char)p[i];
+		h *= 16777619u;
+	}
+
+	return h;
+}
+
+uint32_t kk_hash_u64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+
+	return (uint32_t)x;
+}
+
+uint32_t kk_cell_hash(kk_cell cell) {
+	uint32_t h;
+
+	switch (kk_cell_abstype(cell)) {
+	case kk_type_null:
+		h = 0x9e3779b9;
 		break;
-	case kk_type_array:;
-		kk_array *arr = (kk_array *)o->ptr_val;
-		for (int i=0; i < arr->len; i++)
-			kk_gcobj_inc(&arr->data[i]);
+	case kk_type_float:
+	case kk_type_int:;
+		// -0 and 0 are equal and so are ints and floats with the same
+		// value, so they have to hash the same
+		kk_float f = KK_NUM(cell) == 0 ? 0 : KK_NUM(cell);
+		h = kk_hash_u64(kk_cell_float(f));
+		break;
+	case kk_type_char:
+		h = kk_hash_u64(cell);
 		break;
+	case kk_type_string:
+		h = kk_hash_bytes(STR(GCOBJ(cell))->data, STR(GCOBJ(cell))->len);
+		break;
+	default:
+		h = kk_hash_u64(cell);
 	}
 
-	o->refs++;
+	return h ? h : 1;
 }
 
-void kk_gcobj_free(kk_gcobj *o);
-void kk_cell_free(kk_cell cell) {
-	switch (cell.type) {
-	case kk_type_gcobj:
-		kk_gcobj_free(GCOBJ(cell));
-		break;
+// strings compare by content, other gc objects by identity.
+kk_bool kk_cell_key_eq(kk_cell a, kk_cell b) {
+	if (KK_IS_NUM(a) && KK_IS_NUM(b))
+		return KK_NUM(a) == KK_NUM(b);
+
+	kk_type type = kk_cell_abstype(a);
+	if (type != kk_cell_abstype(b))
+		return 0;
+
+	switch (type) {
+	case kk_type_null:
+		return 1;
+	case kk_type_char:
+		return a == b;
+	case kk_type_string:;
+		kk_string *as = STR(GCOBJ(a)), *bs = STR(GCOBJ(b));
+		return as->len == bs->len && !memcmp(as->data, bs->data, as->len);
+	default:
+		return a == b;
 	}
 }
 
-void kk_gcobj_dec(kk_cell *c);
-void kk_gcobj_free(kk_gcobj *o) {
-	switch (o->type) {
-	case kk_type_array:
-		free(((kk_array *)o->ptr_val)->data);
-		break;
+kk_gcobj *kk_table_new(void) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_table, sizeof(kk_table));
+	kk_table *t = TABLE(o);
+	memset(t, 0, sizeof(kk_table));
+
+	t->cap = KK_TABLE_MIN_CAP;
+	t->items = calloc(t->cap, sizeof(kk_table_item));
+	if (!t->items)
+		kk_runtime_error("Could not allocate a table.");
+
+	return o;
+}
+
+kk_table_item *kk_table_slot(kk_table_item *items, int cap, uint32_t hash, kk_cell key) {
+	for (int i = hash & (cap - 1);; i = (i + 1) & (cap - 1)) {
+		if (!items[i].hash || (items[i].hash == hash && kk_cell_key_eq(items[i].key, key)))
+			return &items[i];
+	}
+}
+
+void kk_table_migrate(kk_table *t, int n) {
+	for (; n > 0 && t->old_pos < t->old_cap; n--, t->old_pos++) {
+		kk_table_item *it = &t->old[t->old_pos];
+		if (it->hash)
+			*kk_table_slot(t->items, t->cap, it->hash, it->key) = *it;
 	}
 
-	free(o->ptr_val);
-	free(o);
+	if (t->old_pos == t->old_cap) {
+		free(t->old);
+		t->old = NULL;
+		t->old_cap = 0;
+		t->old_pos = 0;
+	}
 }
 
-void kk_gcobj_dec(kk_cell *c) {
-	if (c->type != kk_type_gcobj)
+// Returns the item holding key, or NULL.
+kk_table_item *kk_table_find(kk_table *t, kk_cell key, uint32_t hash) {
+	if (t->old)
+		kk_table_migrate(t, KK_TABLE_MIGRATE);
+
+	kk_table_item *it = kk_table_slot(t->items, t->cap, hash, key);
+	if (it->hash)
+		return it;
+
+	if (!t->old)
+		return NULL;
+
+	// slots before old_pos are stale copies, but they stay in place so the
+	// probe sequences aren't broken.
+	for (int i = hash & (t->old_cap - 1);; i = (i + 1) & (t->old_cap - 1)) {
+		it = &t->old[i];
+		if (!it->hash)
+			return NULL;
+
+		if (i >= t->old_pos && it->hash == hash && kk_cell_key_eq(it->key, key))
+			return it;
+	}
+}
+
+// Takes ownership of key and val.
+void kk_table_set(kk_table *t, kk_cell key, kk_cell val) {
+	uint32_t hash = kk_cell_hash(key);
+
+	kk_table_item *it = kk_table_find(t, key, hash);
+	if (it) {
+		kk_gcobj_dec(&key);
+		kk_gcobj_dec(&it->val);
+		it->val = val;
 		return;
+	}
 
-	kk_gcobj *o = ((kk_gcobj *)c->ptr_val);
+	if ((t->len + 1) * 4 > t->cap * 3) {
+		if (t->old)
+			kk_table_migrate(t, t->old_cap);
 
-	switch (o->type) {
-	case kk_type_cons:
-		kk_gcobj_dec(&((kk_cons *)o->ptr_val)->car);
-		kk_gcobj_dec(&((kk_cons *)o->ptr_val)->cdr);
-		break;
-	case kk_type_array:;
-		kk_array *arr = (kk_array *)o->ptr_val;
-		for (int i=0; i < arr->len; i++)
-			kk_gcobj_dec(&arr->data[i]);
-		break;
+		t->old = t->items;
+		t->old_cap = t->cap;
+		t->old_pos = 0;
+
+		t->cap *= 2;
+		t->items = calloc(t->cap, sizeof(kk_table_item));
+		if (!t->items)
+			kk_runtime_error("Could not allocate a table.");
+	}
+
+	// a key string that is still referenced elsewhere can be changed by +,
+	// the table keeps a copy of its bytes then. The original isn't shared,
+	// so it doesn't have to copy itself on its next change.
+	kk_gcobj *ko = KK_IS_GCOBJ(key) ? GCOBJ(key) : NULL;
+	if (ko && ko->type == kk_type_string && !ko->immortal && ko->refs > 1) {
+		kk_cell copy = kk_cell_gcobj(kk_string_new(STR(ko)->data, STR(ko)->len));
+		kk_gcobj_dec(&key);
+		key = copy;
 	}
 
-	o->refs--;
+	it = kk_table_slot(t->items, t->cap, hash, key);
+	it->hash = hash;
+	it->key = key;
+	it->val = val;
+	t->len++;
+}
+
+// Stores a number in a float array, or a char or a number in a byte array.
+void kk_tarray_set(kk_gcobj *o, int index, kk_cell val) {
+	if (o->type == kk_type_farray) {
+		if (!KK_IS_NUM(val))
+			kk_runtime_error("Cannot put %s into a float array.", type_strs[kk_cell_abstype(val)]);
 
-	if (o->refs <= 0)
-		kk_gcobj_free(o);
+		TARRAY(o)->f[index] = KK_NUM(val);
+		return;
+	}
+
+	if (KK_IS_CHAR(val))
+		TARRAY(o)->b[index] = KK_CHAR(val);
+	else if (KK_IS_NUM(val))
+		TARRAY(o)->b[index] = (unsigned char)(int64_t)KK_NUM(val);
+	else
+		kk_runtime_error("Cannot put %s into a byte array.", type_strs[kk_cell_abstype(val)]);
 }
 
+// Copies of strings and arrays with at least this many bytes of data share it
+// with the original, smaller ones are copied right away.
+#define KK_SHARE_MIN 64
+
 void kk_cell_copy(kk_cell *target, kk_cell *src) {
 	*target = *src;
-	kk_gcobj *so = (kk_gcobj *)src->ptr_val;
 
-	if (src->type == kk_type_gcobj) {
-		target->ptr_val = malloc(sizeof(kk_gcobj));
-		memcpy(target->ptr_val, src->ptr_val, sizeof(kk_gcobj));
-		kk_gcobj *o = (kk_gcobj *)target->ptr_val;
-		o->refs = 1;
+	if (!KK_IS_GCOBJ(*src))
+		return;
 
-		switch (o->type) {
-		case kk_type_string:
-			o->ptr_val = strdup(so->ptr_val);
+	kk_gcobj *so = GCOBJ(*src);
+	kk_gcobj *o;
+
+	switch (so->type) {
+	case kk_type_string:;
+		kk_string *ss = STR(so);
+		if (ss->len < KK_SHARE_MIN)
+			o = kk_string_new(ss->data, ss->len);
+		else
+			o = kk_string_view(kk_share(so), ss->data, ss->len);
+		break;
+	case kk_type_array:;
+		kk_array *sa = (kk_array *)so->ptr_val;
+		if (sa->len * sizeof(kk_cell) >= KK_SHARE_MIN) {
+			o = kk_array_view(kk_share(so), sa->data, sa->len);
 			break;
-		case kk_type_array:
-			o->ptr_val = memdup(so->ptr_val, sizeof(kk_array));
-			((kk_array *)o->ptr_val)->data = memdup(
-				((kk_array *)so->ptr_val)->data,
-				((kk_array *)so->ptr_val)->len * sizeof(kk_cell));
-			for (int i=0; i < ((kk_array *)o->ptr_val)->len; i++)
-				kk_gcobj_inc(&((kk_array *)o->ptr_val)->data[i]);
+		}
+
+		o = kk_array_new(sa->len);
+		memcpy(((kk_array *)o->ptr_val)->data, sa->data, sa->len * sizeof(kk_cell));
+		for (int i=0; i < sa->len; i++)
+			kk_gcobj_inc(&sa->data[i]);
+		break;
+	case kk_type_farray:
+	case kk_type_barray:
+		if (TARRAY(so)->len * kk_tarray_elem(so->type) >= KK_SHARE_MIN) {
+			o = kk_tarray_view(kk_share(so));
 			break;
-		case kk_type_cons:
-			o->ptr_val = memdup(so->ptr_val, sizeof(kk_cons));
 		}
+
+		o = kk_tarray_new(so->type, TARRAY(so)->len);
+		memcpy(TARRAY(o)->data, TARRAY(so)->data, TARRAY(so)->len * kk_tarray_elem(so->type));
+		break;
+	case kk_type_cons:
+		o = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
+		memcpy(o->ptr_val, so->ptr_val, sizeof(kk_cons));
+		kk_gcobj_inc(&CONS(o)->car);
+		kk_gcobj_inc(&CONS(o)->cdr);
+		break;
+	case kk_type_table:;
+		kk_table *st = TABLE(so);
+		if (st->old)
+			kk_table_migrate(st, st->old_cap);
+
+		o = kk_table_new();
+		for (int i=0; i < st->cap; i++) {
+			kk_table_item *it = &st->items[i];
+			if (!it->hash)
+				continue;
+
+			kk_gcobj_inc(&it->key);
+			kk_gcobj_inc(&it->val);
+			kk_table_set(TABLE(o), it->key, it->val);
+		}
+		break;
+	default:
+		kk_runtime_error("Cannot copy %s.", type_strs[so->type]);
 	}
+
+	*target = kk_cell_gcobj(o);
 }
 
-kk_type kk_cell_abstype(kk_cell cell) {
-	if (cell.type == kk_type_gcobj)
-		return GCOBJ(cell)->type;
-	
-	return cell.type;
+void kk_put_push(const char *str, kk_cell cell) {
+	if (kk_put_len >= kk_put_cap) {
+		kk_put_cap = kk_put_cap ? kk_put_cap * 2 : 64;
+		kk_put_stack = realloc(kk_put_stack, kk_put_cap * sizeof(kk_put_item));
+		if (!kk_put_stack)
+			kk_runtime_error("Could not allocate memory for printing.");
+	}
+
+	kk_put_stack[kk_put_len++] = (kk_put_item){ str, cell };
 }
 
-void kk_cell_put(kk_cell cell, int debug) {
-	switch (kk_cell_abstype(cell)) {
-	case kk_type_char:
-		if (debug)
-			printf("#%c/'%d", cell.char_val, cell.char_val);
-		else
-			printf("%c", cell.char_val);
-		break;
-	case kk_type_float:
-		printf("%f", cell.float_val);
-		break;
-	case kk_type_string:
-		if (debug)
-			printf("\"%s\"", (char *)(GCOBJ(cell)->ptr_val));
-		else
-			printf("%s", (char *)(GCOBJ(cell)->ptr_val));
-		break;
-	case kk_type_cons:
-		printf("( ");
-		kk_cell_put(CONS(GCOBJ(cell))->car, debug);
-		printf(" . ");
-		kk_cell_put(CONS(GCOBJ(cell))->cdr, debug);
-		printf(" )");
-		break;
-	case kk_type_array:
-		printf("[ ");
+void kk_put_table_items(kk_table_item *items, int from, int to) {
+	for (int i=to - 1; i >= from; i--) {
+		if (!items[i].hash)
+			continue;
 
-		kk_array *arr = ((kk_array *)GCOBJ(cell)->ptr_val);
+		kk_put_push(" ", KK_NULL);
+		kk_put_push(NULL, items[i].val);
+		kk_put_push(": ", KK_NULL);
+		kk_put_push(NULL, items[i].key);
+	}
+}
 
-		for (int i=0; i < arr->len; i++) {
-			kk_cell_put(arr->data[i], debug);
-			printf(" ");
+// Nested values are printed using an explicit stack, the items are pushed in
+// reverse, so they pop in order.
+void kk_cell_put(kk_cell cell, int debug) {
+	char buf[32];
+	int base = kk_put_len;
+	kk_put_push(NULL, cell);
+
+	while (kk_put_len > base) {
+		kk_put_item item = kk_put_stack[--kk_put_len];
+		if (item.str) {
+			kk_out_write(item.str, strlen(item.str));
+			continue;
 		}
 
-		printf("]");
-		break;
-	case kk_type_null:
-		printf("null");
-		break;
+		cell = item.cell;
+		switch (kk_cell_abstype(cell)) {
+		case kk_type_char:
+			if (debug) {
+				kk_out_char('#');
+				kk_out_char(KK_CHAR(cell));
+				kk_out_str("/'");
+				kk_out_write(buf, kk_fmt_int(buf, KK_CHAR(cell)));
+			} else {
+				kk_out_char(KK_CHAR(cell));
+			}
+			break;
+		case kk_type_float:
+			kk_out_write(buf, kk_fmt_float(buf, KK_FLOAT(cell)));
+			break;
+		case kk_type_int:
+			kk_out_write(buf, kk_fmt_int(buf, KK_INT(cell)));
+			break;
+		case kk_type_string:
+			if (debug)
+				kk_out_char('"');
+			kk_out_write(STR(GCOBJ(cell))->data, STR(GCOBJ(cell))->len);
+			if (debug)
+				kk_out_char('"');
+			break;
+		case kk_type_cons:
+			kk_out_str("( ");
+			kk_put_push(" )", KK_NULL);
+			kk_put_push(NULL, CONS(GCOBJ(cell))->cdr);
+			kk_put_push(" . ", KK_NULL);
+			kk_put_push(NULL, CONS(GCOBJ(cell))->car);
+			break;
+		case kk_type_array:
+			kk_out_str("[ ");
+			kk_put_push("]", KK_NULL);
+
+			kk_array *arr = ((kk_array *)GCOBJ(cell)->ptr_val);
+			for (int i=arr->len - 1; i >= 0; i--) {
+				kk_put_push(" ", KK_NULL);
+				kk_put_push(NULL, arr->data[i]);
+			}
+			break;
+		case kk_type_farray:
+		case kk_type_barray:
+			kk_out_str("[ ");
+			kk_put_push("]", KK_NULL);
+
+			kk_tarray *ta = TARRAY(GCOBJ(cell));
+			for (int i=ta->len - 1; i >= 0; i--) {
+				kk_put_push(" ", KK_NULL);
+				if (GCOBJ(cell)->type == kk_type_farray)
+					kk_put_push(NULL, kk_cell_float(ta->f[i]));
+				else
+					kk_put_push(NULL, kk_cell_char(ta->b[i]));
+			}
+			break;
+		case kk_type_table:
+			kk_out_str("{ ");
+			kk_put_push("}", KK_NULL);
+
+			kk_table *t = TABLE(GCOBJ(cell));
+			kk_put_table_items(t->old, t->old_pos, t->old_cap);
+			kk_put_table_items(t->items, 0, t->cap);
+			break;
+		case kk_type_null:
+			kk_out_str("null");
+			break;
+		case kk_type_file:
+			kk_out_str("<file ");
+			kk_out_write(buf, kk_fmt_int(buf, STREAM(GCOBJ(cell))->fd));
+			kk_out_char('>');
+			break;
+		default:
+			kk_out_str("<object>");
+			break;
+		}
 	}
 }
 
-void kk_node_free(kk_node *node) { }
+void kk_node_free(kk_node *node) {
+	(void)node;
+}
 
 void kk_list_push_front(kk_node **list, kk_cell data, int off) {
-	if (data.type == kk_type_gcobj)
+	if (KK_IS_GCOBJ(data))
 		kk_gcobj_inc(&data);
 
 	kk_node *node = malloc(sizeof(kk_node));
@@ -295,281 +2121,217 @@ int kk_list_len(kk_node *list) {
 	return len;
 }
 
-kk_bool kk_is_true(kk_cell cell) {
-	switch (cell.type) {
-	case kk_type_char:
-		return cell.char_val;
-	case kk_type_float:
-		return cell.float_val;
-	case kk_type_gcobj:
-		return ((kk_gcobj *)cell.ptr_val)->ptr_val > 0;
-	default:
-		return 0;
-	}
-
-	return 0;
-}
-
-void kk_BUILTIN___EQUAL__(void) {
-	kk_cell a = POP();
-	kk_cell b = POP();
-
+// Values compared with = are consumed.
+kk_cell kk_cmp_eq(kk_cell b, kk_cell a, int at) {
 	kk_bool res = 0;
-	switch (a.type) {
+	switch (kk_cell_type(a)) {
 	case kk_type_null:
-		res = b.type == kk_type_null;
+		res = KK_IS_NULL(b);
 		break;
 
 	case kk_type_gcobj:
-		switch(((kk_gcobj *)a.ptr_val)->type) {
+		switch(GCOBJ(a)->type) {
 		case kk_type_string:
 			if (kk_cell_abstype(b) != kk_type_string)
-				kk_runtime_error(
+				KK_ERROR_AT(at,
 					"Cannot compare string to %s.",
 					type_strs[kk_cell_abstype(b)]);
 			
-			res = !strcmp(
-				(char *)((kk_gcobj *)a.ptr_val)->ptr_val,
-				(char *)((kk_gcobj *)b.ptr_val)->ptr_val);
+			kk_string *as = STR(GCOBJ(a)), *bs = STR(GCOBJ(b));
+			res = as->len == bs->len && !memcmp(as->data, bs->data, as->len);
 			break;
 
 		default:
-			kk_runtime_error("Cannot compare %s.", type_strs[((kk_gcobj *)a.ptr_val)->type]);
+			KK_ERROR_AT(at, "Cannot compare %s.", type_strs[GCOBJ(a)->type]);
 		}
   
 		break;
 	
+	case kk_type_int:
+		if (KK_IS_INT(b)) {
+			res = a == b;
+			break;
+		}
+		// fallthrough
 	case kk_type_float:
-		if (b.type != kk_type_float)
-			kk_runtime_error("Cannot compare float to %s.", type_strs[kk_cell_abstype(b)]);
+		if (!KK_IS_NUM(b))
+			KK_ERROR_AT(at, "Cannot compare float to %s.", type_strs[kk_cell_abstype(b)]);
 
-		res = a.float_val == b.float_val;
+		res = KK_NUM(a) == KK_NUM(b);
 		break;
 
 	default:
-		kk_runtime_error("Cannot compare %s.", type_strs[kk_cell_abstype(a)]);
+		KK_ERROR_AT(at, "Cannot compare %s.", type_strs[kk_cell_abstype(a)]);
 	}
 
 	kk_gcobj_dec(&a);
 	kk_gcobj_dec(&b);
 
-	PUSH(char, char, res);
+	return kk_cell_char(res);
+}
+
+void kk_BUILTIN___EQUAL__(void) {
+	kk_cell a = POP();
+	*stack = kk_cmp_eq(*stack, a, -1);
 }
 
 void kk_BUILTIN___DIV____EQUAL__(void) {
-	kk_BUILTIN___EQUAL__();
-	stack->char_val = !stack->char_val;
+	kk_cell a = POP();
+	*stack = kk_cmp_ne(*stack, a, -1);
 }
 
 void kk_BUILTIN___PLUS__(void) {
 	kk_cell a = POP();
 
-	switch (a.type) {
+	switch (kk_cell_type(a)) {
 	case kk_type_gcobj:;
 		kk_cell b = POP();
 
-		switch(((kk_gcobj *)a.ptr_val)->type) {
+		switch(GCOBJ(a)->type) {
 		case kk_type_string:
-			if (((kk_gcobj *)b.ptr_val)->type != kk_type_string)
-				kk_runtime_error("Cannot add string to %s.", type_strs[((kk_gcobj *)b.ptr_val)->type]);
+			if (kk_cell_abstype(b) != kk_type_string)
+				kk_runtime_error("Cannot add string to %s.", type_strs[kk_cell_abstype(b)]);
 			
-			kk_gcobj *aobj = (kk_gcobj *)a.ptr_val;
-			kk_gcobj *bobj = (kk_gcobj *)b.ptr_val;
-
-			bobj->ptr_val = realloc(
-				bobj->ptr_val,
-				strlen((char *)aobj->ptr_val) + strlen((char *)bobj->ptr_val) + 1);
-
-			strcat((char *)bobj->ptr_val, (char *)aobj->ptr_val);
+			// a and b can be the same string, a is read after b is made
+			// writable
+			kk_string *bs = kk_string_mut(&b);
+			kk_string *as = STR(GCOBJ(a));
+			kk_string_append(bs, as->data, as->len);
 
 			*++stack = b;
 			kk_gcobj_dec(&a);
-			kk_gcobj_dec(&b);
 			break;
 
 		case kk_type_array:
 			if (kk_cell_abstype(b) != kk_type_array)
 				kk_runtime_error("Cannot add array to %s.", type_strs[kk_cell_abstype(b)]);
 
-			kk_array *aa = (kk_array *)(((kk_gcobj *)(a.ptr_val))->ptr_val);
+			kk_array *aa = (kk_array *)GCOBJ(a)->ptr_val;
 			kk_array *ba = (kk_array *)(GCOBJ(b)->ptr_val);
 
-			ba->len += aa->len;
+			// aa and ba can be the same array
+			int alen = aa->len;
+			kk_array_reserve(ba, ba->len + alen);
+			memcpy(ba->data + ba->len, aa->data, alen * sizeof(kk_cell));
+			for (int i=0; i < alen; i++)
+				kk_gcobj_inc(&ba->data[ba->len + i]);
+			ba->len += alen;
+
+			*++stack = b;
+			kk_gcobj_dec(&a);
+
+			break;
+
+		case kk_type_farray:
+		case kk_type_barray:
+			if (kk_cell_abstype(b) != GCOBJ(a)->type)
+				kk_runtime_error("Cannot add %s to %s.",
+					type_strs[GCOBJ(a)->type], type_strs[kk_cell_abstype(b)]);
+
+			kk_tarray *at = TARRAY(GCOBJ(a)), *bt = TARRAY(GCOBJ(b));
+			size_t elem = kk_tarray_elem(GCOBJ(a)->type);
 
-			ba->data = realloc(ba->data, ba->len * sizeof(kk_cell));
-			memcpy(ba->data + (ba->len - aa->len),
-				aa->data, aa->len * sizeof(kk_cell));
+			// at and bt can be the same array
+			int atlen = at->len;
+			kk_tarray_reserve(GCOBJ(b), bt->len + atlen);
+			memcpy((char *)bt->data + bt->len * elem, at->data, atlen * elem);
+			bt->len += atlen;
 
 			*++stack = b;
 			kk_gcobj_dec(&a);
-			kk_gcobj_dec(&b);
 
 			break;
 
 		default:
-			kk_runtime_error("Cannot add %s.", type_strs[((kk_gcobj *)a.ptr_val)->type]);
+			kk_runtime_error("Cannot add %s.", type_strs[GCOBJ(a)->type]);
 
 		}
   
 		break;
 	
+	case kk_type_int:
+		if (KK_IS_INT(*stack)) {
+			*stack = kk_cell_int64((int64_t)KK_INT(*stack) + KK_INT(a));
+			break;
+		}
+		// fallthrough
 	case kk_type_float:
-		if (!stack)
-			kk_runtime_error("The stack is empty.");
-		if (stack->type != kk_type_float)
-			kk_runtime_error("Cannot add float to %s.", type_strs[b.type]);
+		if (!KK_IS_NUM(*stack))
+			kk_runtime_error("Cannot add float to %s.", type_strs[kk_cell_abstype(*stack)]);
 
-		stack->float_val += a.float_val;
+		*stack = kk_cell_float(KK_NUM(*stack) + KK_NUM(a));
 		break;
 
 	default:
-		kk_runtime_error("Cannot add %s.", type_strs[a.type]);
+		kk_runtime_error("Cannot add %s.", type_strs[kk_cell_abstype(a)]);
 
 	}
 }
 
 void kk_BUILTIN___MINUS__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == kk_type_float && stack->type == kk_type_float) {
-		stack->float_val -= a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot subtract %s from %s.", type_strs[a.type]);
-	}
+	*stack = kk_arith_sub(*stack, a, -1);
 }
 
 void kk_BUILTIN___MUL__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		stack->float_val *= a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_arith_mul(*stack, a, -1);
 }
 
 void kk_BUILTIN___DIV__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		if (a.float_val == 0)
-			kk_runtime_error("Division by zero.");
-
-		stack->float_val /= a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_arith_div(*stack, a, -1);
 }
 
 void kk_BUILTIN___MOD__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		if (a.float_val == 0)
-			kk_runtime_error("Division by zero.");
-
-		stack->float_val = (int)stack->float_val % (int)a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_arith_mod(*stack, a, -1);
 }
 
 void kk_BUILTIN___SMALLER__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		stack->float_val = stack->float_val < a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_cmp_lt(*stack, a, -1);
 }
 
 void kk_BUILTIN___BIGGER__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		stack->float_val = stack->float_val > a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_cmp_gt(*stack, a, -1);
 }
 
 void kk_BUILTIN___SMALLER____EQUAL__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		stack->float_val = stack->float_val <= a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_cmp_le(*stack, a, -1);
 }
 
 void kk_BUILTIN___BIGGER____EQUAL__(void) {
 	kk_cell a = POP();
-	if (!stack)
-		kk_runtime_error("The stack is empty.");
-
-	if (a.type == stack->type && a.type == kk_type_float) {
-		stack->float_val = stack->float_val >= a.float_val;
-	} else {
-		kk_gcobj_dec(&a);
-
-		kk_runtime_error("Cannot multiply %s with %s.", type_strs[a.type]);
-	}
+	*stack = kk_cmp_ge(*stack, a, -1);
 }
 
 void kk_BUILTIN_s__BIGGER__(void) {
-	printf("<%d> ", STACKLEN() + 1);
+	char buf[32];
+	kk_out_char('<');
+	kk_out_write(buf, kk_fmt_int(buf, STACKLEN() + 1));
+	kk_out_str("> ");
 
 	for (kk_cell *p = stack_storage + 1; p <= stack; p++) {
 		kk_cell_put(*p, 1);
-		printf(" ");
+		kk_out_char(' ');
 	}
 
-	printf("\n");
+	kk_out_newline();
 }
 
 void kk_BUILTIN_cons(void) {
 	if (STACKLEN() < 2)
 		kk_runtime_error("Not enough values on the stack to cons.");
 
-	kk_gcobj *obj = malloc(sizeof(kk_gcobj));
-	obj->refs = 1; obj->type = kk_type_cons;
+	kk_gcobj *obj = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
 
-	kk_cons *cons = malloc(sizeof(kk_cons));
+	kk_cons *cons = (kk_cons *)obj->ptr_val;
 	cons->cdr = POP();
 	cons->car = POP();
 
-	obj->ptr_val = cons;
-
 	PUSH(gcobj, ptr, obj);
 }
 
@@ -581,7 +2343,7 @@ void kk_BUILTIN_car(void) {
 		kk_runtime_error("Cannot get car of a %s.", type_strs[type]);
 
 	*++stack = CONS(GCOBJ(cell))->car;
-	kk_gcobj_inc(stack-1);
+	kk_gcobj_inc(stack);
 }
 
 void kk_BUILTIN_cdr(void) {
@@ -592,7 +2354,7 @@ void kk_BUILTIN_cdr(void) {
 		kk_runtime_error("Cannot get cdr of a %s.", type_strs[type]);
 
 	*++stack = CONS(GCOBJ(cell))->cdr;
-	kk_gcobj_inc(stack-1);
+	kk_gcobj_inc(stack);
 }
 
 void kk_BUILTIN_uncons(void) {
@@ -603,9 +2365,9 @@ void kk_BUILTIN_uncons(void) {
 		kk_runtime_error("Cannot uncons a %s.", type_strs[type]);
 
 	*++stack = CONS(GCOBJ(cell))->car;
-	//kk_gcobj_inc(stack-1);
+	kk_gcobj_inc(stack);
 	*++stack = CONS(GCOBJ(cell))->cdr;
-	//kk_gcobj_inc(stack-1);
+	kk_gcobj_inc(stack);
 
 	kk_gcobj_dec(&cell);
 }
@@ -622,9 +2384,9 @@ void kk_BUILTIN_swap(void) {
 	if (STACKLEN() < 2)
 		kk_runtime_error("Cannot swap on a stack shorter than 2.");
 
-	tmp_cell = *stack;
+	kk_cell top = *stack;
 	*stack = stack[-1];
-	stack[-1] = tmp_cell;
+	stack[-1] = top;
 }
 
 void kk_BUILTIN_rot(void) {
@@ -641,9 +2403,11 @@ void kk_BUILTIN_tuck(void) {
 	if (STACKLEN() < 2)
 		kk_runtime_error("Cannot tuck a stack shorter than 2.");
 
+	// ( b a -- a b a )
 	stack[1] = *stack;
 	*stack = stack[-1];
 	stack[-1] = stack[1];
+	kk_gcobj_inc(++stack);
 }
 
 void kk_BUILTIN_over(void) {
@@ -651,58 +2415,89 @@ void kk_BUILTIN_over(void) {
 		kk_runtime_error("Cannot over a stack shorter than 2.");
 
 	stack[1] = stack[-1];
-	stack++;
+	kk_gcobj_inc(++stack);
+}
+
+int kk_cell_index(kk_cell cell) {
+	if (KK_IS_INT(cell))
+		return KK_INT(cell);
+
+	if (!KK_IS_FLOAT(cell))
+		kk_runtime_error("Cannot use %s as an index.", type_strs[kk_cell_abstype(cell)]);
+
+	return KK_FLOAT(cell);
 }
 
 void kk_BUILTIN_mka(void) {
 	kk_cell lencell = POP();
 
-	if (lencell.type != kk_type_float)
-		kk_runtime_error("Cannot use %s as length.", type_strs[lencell.type]);
+	if (!KK_IS_NUM(lencell))
+		kk_runtime_error("Cannot use %s as length.", type_strs[kk_cell_abstype(lencell)]);
 
-	kk_array *arr = malloc(sizeof(kk_array));
-	arr->data = calloc(sizeof(kk_cell), lencell.float_val);
-	arr->len = lencell.float_val;
+	int len = kk_cell_index(lencell);
+	if (len < 0)
+		kk_runtime_error("Cannot make an array of negative length.");
 
-	kk_gcobj *o = malloc(sizeof(kk_gcobj));
-	o->refs = 1; o->type = kk_type_array;
-	o->ptr_val = arr;
-	PUSH(gcobj, ptr, arr);
+	PUSH(gcobj, ptr, kk_array_new(len));
 }
 
 void kk_BUILTIN_get(void) {
 	kk_cell icell = POP();
 
-	if (icell.type != kk_type_float)
-		kk_runtime_error("Cannot use %s as an index.", type_strs[icell.type]);
+	if (kk_cell_abstype(*stack) == kk_type_table) {
+		kk_table_item *it = kk_table_find(TABLE(GCOBJ(*stack)), icell, kk_cell_hash(icell));
+		kk_gcobj_dec(&icell);
+
+		if (it) {
+			*++stack = it->val;
+			kk_gcobj_inc(stack);
+		} else {
+			PUSH(null, char, 0);
+		}
+
+		return;
+	}
 
-	int index = icell.float_val;
+	int index = kk_cell_index(icell);
 
 	switch (kk_cell_abstype(*stack)) {
 	case kk_type_array:;
 		kk_array *arr = (kk_array *)GCOBJ(*stack)->ptr_val;
 
-		if (index > arr->len)
+		if (index < 0 || index >= arr->len)
 			kk_runtime_error("Index %d out of range %d.", index, arr->len);
 
 		*++stack = arr->data[index];
+		kk_gcobj_inc(stack);
+		break;
+
+	case kk_type_farray:
+	case kk_type_barray:;
+		kk_tarray *ta = TARRAY(GCOBJ(*stack));
+
+		if (index < 0 || index >= ta->len)
+			kk_runtime_error("Index %d out of range %d.", index, ta->len);
+
+		if (GCOBJ(*stack)->type == kk_type_farray)
+			PUSH(float, float, ta->f[index]);
+		else
+			PUSH(char, char, ta->b[index]);
 		break;
 
 	case kk_type_string:;
-		char *s = (char *)GCOBJ(*stack)->ptr_val;
+		kk_string *s = STR(GCOBJ(*stack));
 
-		int len = strlen(s);
-		if (index > len)
-			kk_runtime_error("Index %d out of range %d.", index, len);
+		if (index < 0 || (size_t)index >= s->len)
+			kk_runtime_error("Index %d out of range %d.", index, (int)s->len);
 
-		PUSH(char, char, s[index]);
+		PUSH(char, char, s->data[index]);
 		break;
 
 	case kk_type_cons:;
 		kk_cons *list = (kk_cons *)GCOBJ(*stack)->ptr_val;
 
 		for (int i=0; i < index && list; i++) {
-			kk_type type = list->cdr.type;
+			kk_type type = kk_cell_abstype(list->cdr);
 
 			if (type == kk_type_null)
 				kk_runtime_error("Index %d out of range %d.", index, i);
@@ -710,14 +2505,15 @@ void kk_BUILTIN_get(void) {
 			if (type != kk_type_cons)
 				kk_runtime_error("Trying to index not a list.");
 
-			list = (kk_cons *)(list->cdr.ptr_val);
+			list = CONS(GCOBJ(list->cdr));
 		}
 
 		*++stack = list->car;
+		kk_gcobj_inc(stack);
 		break;
 
 	default:
-		kk_runtime_error("Cannot iterate over %s.", type_strs[stack->type]);
+		kk_runtime_error("Cannot iterate over %s.", type_strs[kk_cell_abstype(*stack)]);
 
 	}
 }
@@ -726,46 +2522,52 @@ void kk_BUILTIN_set(void) {
 	kk_cell val = POP();
 	kk_cell icell = POP();
 
-	if (icell.type != kk_type_float)
-		kk_runtime_error("Cannot use %s as an index.", type_strs[icell.type]);
+	if (kk_cell_abstype(*stack) == kk_type_table) {
+		kk_table_set(TABLE(GCOBJ(*stack)), icell, val);
+		return;
+	}
 
-	int index = icell.float_val;
+	int index = kk_cell_index(icell);
 
 	switch (kk_cell_abstype(*stack)) {
 	case kk_type_array:;
-		kk_array *arr = (kk_array *)GCOBJ(*stack)->ptr_val;
+		kk_array *arr = kk_array_mut(GCOBJ(*stack));
 
-		if (index > arr->len)
+		if (index < 0 || index >= arr->len)
 			kk_runtime_error("Index %d out of range %d.", index, arr->len);
 
 		kk_gcobj_dec(&arr->data[index]);
 		arr->data[index] = val;
-		kk_gcobj_inc(&arr->data[index]);
 		break;
 
-	case kk_type_string:;
-		if (val.type != kk_type_char)
-			kk_runtime_error("Trying to set string value with %s.", type_strs[val.type]);
+	case kk_type_farray:
+	case kk_type_barray:;
+		kk_tarray *ta = kk_tarray_mut(GCOBJ(*stack));
 
-		char *s = (char *)GCOBJ(*stack)->ptr_val;
+		if (index < 0 || index >= ta->len)
+			kk_runtime_error("Index %d out of range %d.", index, ta->len);
+
+		kk_tarray_set(GCOBJ(*stack), index, val);
+		break;
+
+	case kk_type_string:;
+		if (!KK_IS_CHAR(val))
+			kk_runtime_error("Trying to set string value with %s.", type_strs[kk_cell_abstype(val)]);
 
-		int len = strlen(s);
-		if (index > len)
-			kk_runtime_error("Index %d out of range %d.", index, len);
+		kk_string *s = STR(GCOBJ(*stack));
 
-		if (val.type != kk_type_char)
-			kk_runtime_error(
-				"Setting a string character with %s",
-				type_strs[val.type]);
+		if (index < 0 || (size_t)index >= s->len)
+			kk_runtime_error("Index %d out of range %d.", index, (int)s->len);
 
-		s[index] = val.char_val;
+		s = kk_string_mut(stack);
+		s->data[index] = KK_CHAR(val);
 		break;
 
 	case kk_type_cons:;
 		kk_cons *list = (kk_cons *)GCOBJ(*stack)->ptr_val;
 
 		for (int i=0; i < index && list; i++) {
-			kk_type type = list->cdr.type;
+			kk_type type = kk_cell_abstype(list->cdr);
 
 			if (type == kk_type_null)
 				kk_runtime_error("Index %d out of range %d.", index, i);
@@ -773,7 +2575,7 @@ void kk_BUILTIN_set(void) {
 			if (type != kk_type_cons)
 				kk_runtime_error("Trying to index not a list.");
 
-			list = (kk_cons *)(list->cdr.ptr_val);
+			list = CONS(GCOBJ(list->cdr));
 		}
 
 		kk_gcobj_dec(&list->car);
@@ -781,7 +2583,7 @@ void kk_BUILTIN_set(void) {
 		break;
 
 	default:
-		kk_runtime_error("Cannot iterate over %s.", type_strs[stack->type]);
+		kk_runtime_error("Cannot iterate over %s.", type_strs[kk_cell_abstype(*stack)]);
 
 	}
 }
@@ -790,7 +2592,7 @@ void kk_BUILTIN_put(void) {
 	kk_cell cell = POP();
 
 	kk_cell_put(cell, 0);
-	printf("\n");
+	kk_out_newline();
 
 	kk_gcobj_dec(&cell);
 }
@@ -800,11 +2602,18 @@ void kk_BUILTIN_len(void) {
 
 	switch (kk_cell_abstype(*stack)) {
 	case kk_type_string:
-		res = strlen((char *)GCOBJ(*stack)->ptr_val);
+		res = STR(GCOBJ(*stack))->len;
 		break;
 	case kk_type_array:
 		res = ((kk_array *)GCOBJ(*stack)->ptr_val)->len;
 		break;
+	case kk_type_table:
+		res = TABLE(GCOBJ(*stack))->len;
+		break;
+	case kk_type_farray:
+	case kk_type_barray:
+		res = TARRAY(GCOBJ(*stack))->len;
+		break;
 	case kk_type_cons:
 		res = 0;
 
@@ -813,7 +2622,7 @@ void kk_BUILTIN_len(void) {
 			node = (kk_cons *)GCOBJ(node->cdr)->ptr_val) {
 				res++;
 
-				if (node->cdr.type == kk_type_null)
+				if (KK_IS_NULL(node->cdr))
 					break;
 
 				if (kk_cell_abstype(node->cdr) != kk_type_cons)
@@ -822,56 +2631,60 @@ void kk_BUILTIN_len(void) {
 
 		break;
 	default:
-		kk_runtime_error("Cannot get length of %s.", type_strs[stack->type]);
+		kk_runtime_error("Cannot get length of %s.", type_strs[kk_cell_abstype(*stack)]);
 	}
 
-	PUSH(float, float, res);
+	PUSH(int, int, res);
 }
 
 void kk_BUILTIN_nip(void) {
 	kk_BUILTIN_swap();
-	tmp_cell = POP();
-	kk_gcobj_dec(&tmp_cell);
+	kk_cell second = POP();
+	kk_gcobj_dec(&second);
 }
 
 void kk_BUILTIN_num(void) {
 	kk_cell cell = POP();
 
-	kk_float res;
+	kk_cell res;
 	switch (kk_cell_abstype(cell)) {
 	case kk_type_string:
-		res = atof((char *)GCOBJ(cell)->ptr_val);
+		res = kk_cell_float(atof(kk_string_cstr(STR(GCOBJ(cell)))));
 		break;
 	case kk_type_char:
-		res = cell.char_val;
+		res = kk_cell_int(KK_CHAR(cell));
 		break;
 	case kk_type_null:
-		res = 0;
+		res = kk_cell_int(0);
 		break;
 	case kk_type_float:
-		res = cell.float_val; // it should not error on float.
+	case kk_type_int:
+		res = cell; // it should not error on float.
 		break;
 	default:
 		kk_runtime_error("Cannot convert %s to num.", type_strs[kk_cell_abstype(cell)]);
 	}
 
 	kk_gcobj_dec(&cell);
-	PUSH(float, float, res);
+	*++stack = res;
 }
 
 void kk_BUILTIN_char(void) {
 	kk_cell cell = POP();
 
 	kk_char res;
-	switch (cell.type) {
+	switch (kk_cell_type(cell)) {
 	case kk_type_char:
-		res = cell.char_val;
+		res = KK_CHAR(cell);
 		break;
 	case kk_type_null:
 		res = 0;
 		break;
 	case kk_type_float:
-		res = cell.float_val;
+		res = KK_FLOAT(cell);
+		break;
+	case kk_type_int:
+		res = KK_INT(cell);
 		break;
 	default:
 		kk_runtime_error("Cannot convert %s to char.", type_strs[kk_cell_abstype(cell)]);
@@ -883,22 +2696,18 @@ void kk_BUILTIN_char(void) {
 
 void kk_BUILTIN_stoa(void) {
 	int len = 0;
-	for (kk_cell *p=stack; p != stack_storage && p->type; p--)
+	for (kk_cell *p=stack; p != stack_storage && !KK_IS_NULL(*p); p--)
 		len++;
 
-	kk_array *arr = malloc(sizeof(kk_array));
-	arr->len = len;
-	arr->data = malloc(sizeof(kk_cell) * len);
+	kk_gcobj *o = kk_array_new(len);
+	kk_array *arr = (kk_array *)o->ptr_val;
 
 	for (int i=0; i < len; i++)
 		arr->data[i] = POP();
 
-	POP();
-	kk_gcobj *o = malloc(sizeof(kk_gcobj));
-	o->type = kk_type_array;
-	o->refs = 1;
-	o->ptr_val = arr;
-
+	// the null that ends the values, if the stack wasn't empty before it
+	if (stack != stack_storage)
+		(void)POP();
 	PUSH(gcobj, ptr, o);
 }
 
@@ -907,59 +2716,560 @@ void kk_BUILTIN_atos(void) {
 	if (kk_cell_abstype(cell) != kk_type_array)
 		kk_runtime_error("Cannot atos a %s.", type_strs[kk_cell_abstype(cell)]);
 
-	kk_array *arr = (kk_array *)cell.ptr_val;
+	kk_array *arr = (kk_array *)GCOBJ(cell)->ptr_val;
 	for (int i=arr->len-1; i >= 0; i--) {
 		*++stack = arr->data[i];
+		kk_gcobj_inc(stack);
+	}
+
+	kk_gcobj_dec(&cell);
+}
+
+void kk_make_tarray(kk_type type) {
+	kk_cell lencell = POP();
+
+	if (!KK_IS_NUM(lencell))
+		kk_runtime_error("Cannot use %s as length.", type_strs[kk_cell_abstype(lencell)]);
+
+	int len = kk_cell_index(lencell);
+	if (len < 0)
+		kk_runtime_error("Cannot make an array of negative length.");
+
+	PUSH(gcobj, ptr, kk_tarray_new(type, len));
+}
+
+void kk_BUILTIN_mkfa(void) {
+	kk_make_tarray(kk_type_farray);
+}
+
+void kk_BUILTIN_mkba(void) {
+	kk_make_tarray(kk_type_barray);
+}
+
+// Converts the array, or for byte arrays also a string, on top of the stack.
+void kk_to_tarray(kk_type type) {
+	kk_cell cell = POP();
+	kk_gcobj *o;
+
+	switch (kk_cell_abstype(cell)) {
+	case kk_type_array:;
+		kk_array *arr = (kk_array *)GCOBJ(cell)->ptr_val;
+		o = kk_tarray_new(type, arr->len);
+		for (int i=0; i < arr->len; i++)
+			kk_tarray_set(o, i, arr->data[i]);
+		break;
+
+	case kk_type_string:
+		if (type != kk_type_barray)
+			goto bad;
+
+		o = kk_tarray_new(type, STR(GCOBJ(cell))->len);
+		memcpy(TARRAY(o)->data, STR(GCOBJ(cell))->data, STR(GCOBJ(cell))->len);
+		break;
+
+	default:
+	bad:
+		kk_runtime_error("Cannot convert %s to %s.",
+			type_strs[kk_cell_abstype(cell)], type_strs[type]);
 	}
 
 	kk_gcobj_dec(&cell);
+	PUSH(gcobj, ptr, o);
+}
+
+void kk_BUILTIN_atofa(void) {
+	kk_to_tarray(kk_type_farray);
+}
+
+void kk_BUILTIN_atoba(void) {
+	kk_to_tarray(kk_type_barray);
+}
+
+void kk_BUILTIN_tatoa(void) {
+	kk_cell cell = POP();
+	kk_type type = kk_cell_abstype(cell);
+	if (!KK_IS_TARRAY(type))
+		kk_runtime_error("Cannot tatoa a %s.", type_strs[type]);
+
+	kk_tarray *ta = TARRAY(GCOBJ(cell));
+	kk_gcobj *o = kk_array_new(ta->len);
+	kk_array *arr = (kk_array *)o->ptr_val;
+
+	for (int i=0; i < ta->len; i++)
+		arr->data[i] = type == kk_type_farray ? kk_cell_float(ta->f[i]) : kk_cell_char(ta->b[i]);
+
+	kk_gcobj_dec(&cell);
+	PUSH(gcobj, ptr, o);
+}
+
+kk_tarray *kk_farray_arg(kk_cell cell, const char *word) {
+	if (kk_cell_abstype(cell) != kk_type_farray)
+		kk_runtime_error("%s takes a float array, not %s.", word, type_strs[kk_cell_abstype(cell)]);
+
+	return TARRAY(GCOBJ(cell));
+}
+
+void kk_BUILTIN_fasum(void) {
+	kk_tarray *a = kk_farray_arg(*stack, "fasum");
+	PUSH(float, float, kk_simd.sum(a->f, a->len));
+}
+
+void kk_BUILTIN_famin(void) {
+	kk_tarray *a = kk_farray_arg(*stack, "famin");
+	if (a->len)
+		PUSH(float, float, kk_simd.min(a->f, a->len));
+	else
+		PUSH(null, char, 0);
+}
+
+void kk_BUILTIN_famax(void) {
+	kk_tarray *a = kk_farray_arg(*stack, "famax");
+	if (a->len)
+		PUSH(float, float, kk_simd.max(a->f, a->len));
+	else
+		PUSH(null, char, 0);
+}
+
+void kk_BUILTIN_fadot(void) {
+	kk_cell bcell = POP();
+	kk_tarray *b = kk_farray_arg(bcell, "fadot");
+	kk_tarray *a = kk_farray_arg(*stack, "fadot");
+
+	if (a->len != b->len)
+		kk_runtime_error("Cannot fadot arrays of length %d and %d.", a->len, b->len);
+
+	kk_float res = kk_simd.dot(a->f, b->f, a->len);
+	kk_gcobj_dec(&bcell);
+	PUSH(float, float, res);
+}
+
+// Applies op to each element of the float array under the top, with either
+// the matching element of the float array or the number on top.
+void kk_farray_op(kk_op op, const char *word) {
+	kk_cell bcell = POP();
+	kk_farray_arg(*stack, word);
+	kk_tarray *a = kk_tarray_mut(GCOBJ(*stack));
+
+	if (KK_IS_NUM(bcell)) {
+		kk_simd.op_scalar(a->f, KK_NUM(bcell), a->len, op);
+		return;
+	}
+
+	kk_tarray *b = kk_farray_arg(bcell, word);
+	if (a->len != b->len)
+		kk_runtime_error("Cannot %s arrays of length %d and %d.", word, a->len, b->len);
+
+	kk_simd.op(a->f, b->f, a->len, op);
+	kk_gcobj_dec(&bcell);
+}
+
+void kk_BUILTIN_fa__PLUS__(void) {
+	kk_farray_op(kk_op_add, "fa+");
+}
+
+void kk_BUILTIN_fa__MINUS__(void) {
+	kk_farray_op(kk_op_sub, "fa-");
+}
+
+void kk_BUILTIN_fa__MUL__(void) {
+	kk_farray_op(kk_op_mul, "fa*");
+}
+
+void kk_BUILTIN_fa__DIV__(void) {
+	kk_farray_op(kk_op_div, "fa/");
+}
+
+void kk_BUILTIN_fafill(void) {
+	kk_cell val = POP();
+	kk_farray_arg(*stack, "fafill");
+	kk_tarray *a = kk_tarray_mut(GCOBJ(*stack));
+
+	if (!KK_IS_NUM(val))
+		kk_runtime_error("Cannot fill a float array with %s.", type_strs[kk_cell_abstype(val)]);
+
+	kk_simd.op_scalar(a->f, KK_NUM(val), a->len, kk_op_set);
+}
+
+void kk_BUILTIN_a__BIGGER__(void) {
+	kk_cell val = POP();
+	kk_type type = kk_cell_abstype(*stack);
+	if (type != kk_type_array)
+		kk_runtime_error("Cannot push to %s.", type_strs[type]);
+
+	kk_array *arr = (kk_array *)GCOBJ(*stack)->ptr_val;
+	kk_array_reserve(arr, arr->len + 1);
+	arr->data[arr->len++] = val;
+}
+
+void kk_BUILTIN_a__SMALLER__(void) {
+	kk_type type = kk_cell_abstype(*stack);
+	if (type != kk_type_array)
+		kk_runtime_error("Cannot pop from %s.", type_strs[type]);
+
+	kk_array *arr = kk_array_mut(GCOBJ(*stack));
+	if (arr->len == 0)
+		kk_runtime_error("Cannot pop from an empty array.");
+
+	*++stack = arr->data[--arr->len];
+}
+
+void kk_BUILTIN_reserve(void) {
+	kk_cell capcell = POP();
+
+	int cap = kk_cell_index(capcell);
+
+	kk_type type = kk_cell_abstype(*stack);
+	switch (type) {
+	case kk_type_array:
+		kk_array_reserve((kk_array *)GCOBJ(*stack)->ptr_val, cap);
+		break;
+	case kk_type_string:
+		kk_string_reserve(kk_string_mut(stack), cap);
+		break;
+	case kk_type_farray:
+	case kk_type_barray:
+		kk_tarray_reserve(GCOBJ(*stack), cap);
+		break;
+	default:
+		kk_runtime_error("Cannot reserve space in %s.", type_strs[type]);
+	}
 }
 
 void kk_BUILTIN_l__BIGGER__(void) {
 	kk_cell val = POP();
-	kk_type type = stack->type;
+	kk_type type = kk_cell_abstype(*stack);
 	if (type != kk_type_cons)
 		kk_runtime_error("Cannot push to %s.", type_strs[type]);
 
-	kk_cons *cons = malloc(sizeof(kk_cons));
+	kk_gcobj *o = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
+	kk_cons *cons = (kk_cons *)o->ptr_val;
 	cons->car = val;
-
 	cons->cdr = *stack;
-	kk_gcobj *o = malloc(sizeof(kk_gcobj));
-	o->type = kk_type_cons;
-	o->refs = 1;
 
-	stack->ptr_val = o;
+	*stack = kk_cell_gcobj(o);
 }
 
-void kk_BUILTIN_read(void) {
-	char *buf = malloc(256);
-	int len = 0;
-	int cap = 256;
+void kk_BUILTIN_mkt(void) {
+	PUSH(gcobj, ptr, kk_table_new());
+}
+
+// Finds the first occurrence of needle in hay. Single bytes go to memchr, longer
+// needles to memmem, which uses the two-way algorithm in glibc.
+static inline const char *kk_search(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+	if (nlen == 1)
+		return memchr(hay, *needle, hlen);
+
+	return memmem(hay, hlen, needle, nlen);
+}
+
+// Returns the bytes of a string or a char needle. c is the char's storage.
+const char *kk_needle(kk_cell *cell, char *c, size_t *len, const char *word) {
+	switch (kk_cell_abstype(*cell)) {
+	case kk_type_char:
+		*c = KK_CHAR(*cell);
+		*len = 1;
+		return c;
+	case kk_type_string:
+		*len = STR(GCOBJ(*cell))->len;
+		return STR(GCOBJ(*cell))->data;
+	default:
+		kk_runtime_error("Cannot %s with %s.", word, type_strs[kk_cell_abstype(*cell)]);
+	}
+
+	return NULL;
+}
+
+void kk_BUILTIN_contains(void) {
+	kk_cell key = POP();
+
+	kk_bool res = 0;
+	switch (kk_cell_abstype(*stack)) {
+	case kk_type_table:
+		res = kk_table_find(TABLE(GCOBJ(*stack)), key, kk_cell_hash(key)) != NULL;
+		break;
+	case kk_type_string:;
+		char c;
+		size_t nlen;
+		const char *needle = kk_needle(&key, &c, &nlen, "search a string");
+		kk_string *hay = STR(GCOBJ(*stack));
+		res = nlen == 0 || kk_search(hay->data, hay->len, needle, nlen) != NULL;
+		break;
+	default:
+		kk_runtime_error("Cannot search in %s.", type_strs[kk_cell_abstype(*stack)]);
+	}
+
+	kk_gcobj_dec(&key);
+	PUSH(char, char, res);
+}
+
+// Splits a string on every occurrence of the separator. The separators are
+// counted first, so the array is allocated once with the right length. The
+// parts are views into the data of the string.
+void kk_BUILTIN_split(void) {
+	kk_cell sep = POP();
+	kk_cell cell = POP();
+
+	if (kk_cell_abstype(cell) != kk_type_string)
+		kk_runtime_error("Cannot split %s.", type_strs[kk_cell_abstype(cell)]);
 
 	char c;
-	while ((c = getchar()) != '\n') {
-		buf[len++] = c;
-		if (len >= cap) {
-			buf = realloc(buf, cap + 256);
-			cap += 256;
-		}
+	size_t nlen;
+	const char *needle = kk_needle(&sep, &c, &nlen, "split");
+	if (nlen == 0)
+		kk_runtime_error("Cannot split with an empty separator.");
+
+	kk_gcobj *base = kk_share(GCOBJ(cell));
+	kk_string *s = STR(GCOBJ(cell));
+	const char *end = s->data + s->len;
+
+	int count = 1;
+	for (const char *p = s->data; (p = kk_search(p, end - p, needle, nlen)); p += nlen)
+		count++;
+
+	kk_gcobj *o = kk_array_new(count);
+	kk_array *arr = (kk_array *)o->ptr_val;
+
+	char *start = s->data;
+	for (int i=0; i < count - 1; i++) {
+		const char *p = kk_search(start, end - start, needle, nlen);
+		arr->data[i] = kk_cell_gcobj(kk_string_view(base, start, p - start));
+		start = s->data + (p - s->data) + nlen;
 	}
-	buf[len] = 0;
+	arr->data[count - 1] = kk_cell_gcobj(kk_string_view(base, start, end - start));
 
-	kk_gcobj *o = malloc(sizeof(kk_gcobj));
-	o->type = kk_type_string;
-	o->refs = 1;
-	o->ptr_val = buf;
+	kk_gcobj_dec(&cell);
+	kk_gcobj_dec(&sep);
+	PUSH(gcobj, ptr, o);
+}
+
+// Takes the part of a string or an array between from and to. The result
+// shares data with the original until one of them is modified.
+void kk_BUILTIN_slice(void) {
+	int to = kk_cell_index(POP());
+	int from = kk_cell_index(POP());
+	kk_cell cell = POP();
+
+	kk_type type = kk_cell_abstype(cell);
+	if (type != kk_type_string && type != kk_type_array)
+		kk_runtime_error("Cannot slice %s.", type_strs[type]);
+
+	int len = type == kk_type_string ? (int)STR(GCOBJ(cell))->len : ((kk_array *)GCOBJ(cell)->ptr_val)->len;
+	if (from < 0 || to < from || to > len)
+		kk_runtime_error("Slice %d to %d out of range %d.", from, to, len);
+
+	kk_gcobj *base = kk_share(GCOBJ(cell));
+	kk_gcobj *o;
+	if (type == kk_type_string)
+		o = kk_string_view(base, STR(GCOBJ(cell))->data + from, to - from);
+	else
+		o = kk_array_view(base, ((kk_array *)GCOBJ(cell)->ptr_val)->data + from, to - from);
+
+	kk_gcobj_dec(&cell);
 	PUSH(gcobj, ptr, o);
 }
 
+void kk_BUILTIN_ttol(void) {
+	kk_cell cell = POP();
+	if (kk_cell_abstype(cell) != kk_type_table)
+		kk_runtime_error("Cannot ttol a %s.", type_strs[kk_cell_abstype(cell)]);
+
+	kk_table *t = TABLE(GCOBJ(cell));
+	if (t->old)
+		kk_table_migrate(t, t->old_cap);
+
+	kk_cell list = KK_NULL;
+	for (int i=0; i < t->cap; i++) {
+		kk_table_item *it = &t->items[i];
+		if (!it->hash)
+			continue;
+
+		kk_gcobj *pair = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
+		CONS(pair)->car = it->key;
+		CONS(pair)->cdr = it->val;
+		kk_gcobj_inc(&it->key);
+		kk_gcobj_inc(&it->val);
+
+		kk_gcobj *node = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
+		CONS(node)->car = kk_cell_gcobj(pair);
+		CONS(node)->cdr = list;
+		list = kk_cell_gcobj(node);
+	}
+
+	kk_gcobj_dec(&cell);
+	*++stack = list;
+}
+
+kk_gcobj *kk_stream_new(int fd, int owned) {
+	kk_gcobj *o = kk_gcobj_new(kk_type_file, sizeof(kk_stream));
+	*STREAM(o) = (kk_stream){ .fd = fd, .owned = owned };
+
+	return o;
+}
+
+// Refills the buffer of f, returns 0 at the end of the file.
+int kk_stream_fill(kk_stream *f) {
+	if (!f->buf) {
+		f->buf = malloc(KK_STREAM_BUF);
+		if (!f->buf)
+			kk_runtime_error("Could not allocate a file buffer.");
+	}
+
+	if (f->fd == STDIN_FILENO)
+		kk_out_flush();
+
+	ssize_t n;
+	do {
+		n = read(f->fd, f->buf, KK_STREAM_BUF);
+	} while (n < 0 && errno == EINTR);
+
+	f->pos = 0;
+	f->len = n > 0 ? n : 0;
+
+	return n > 0;
+}
+
+// Returns the file on top of the stack. The words reading from it replace it
+// with the result once they're done.
+kk_stream *kk_top_stream(const char *word) {
+	if (kk_cell_abstype(*stack) != kk_type_file)
+		kk_runtime_error("Cannot %s from %s.", word, type_strs[kk_cell_abstype(*stack)]);
+
+	return STREAM(GCOBJ(*stack));
+}
+
+// Reads all that's left of f. Regular files are mapped and the string points
+// straight into the mapping, unless the file ends on a page boundary, because
+// then there's no zero byte after the data.
+kk_gcobj *kk_stream_read_all(kk_gcobj *fo) {
+	kk_stream *f = STREAM(fo);
+	struct stat st;
+	off_t off = lseek(f->fd, 0, SEEK_CUR);
+
+	if (f->pos >= f->len && !f->map && off >= 0 && fstat(f->fd, &st) == 0 &&
+		S_ISREG(st.st_mode) && st.st_size > off && st.st_size % sysconf(_SC_PAGESIZE)) {
+
+		char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+		if (map != MAP_FAILED) {
+			f->map = map;
+			f->map_len = st.st_size;
+			lseek(f->fd, 0, SEEK_END);
+
+			return kk_string_view(fo, map + off, st.st_size - off);
+		}
+	}
+
+	kk_gcobj *o = kk_string_new(f->buf ? f->buf + f->pos : "", f->len - f->pos);
+	f->pos = f->len;
+	while (kk_stream_fill(f)) {
+		kk_string_append(STR(o), f->buf, f->len);
+		f->pos = f->len;
+	}
+
+	return o;
+}
+
+void kk_BUILTIN_open(void) {
+	kk_cell mode = POP();
+	kk_cell path = POP();
+
+	if (kk_cell_abstype(path) != kk_type_string || kk_cell_abstype(mode) != kk_type_string)
+		kk_runtime_error("open takes a path and a mode string, got %s and %s.",
+			type_strs[kk_cell_abstype(path)], type_strs[kk_cell_abstype(mode)]);
+
+	const char *m = kk_string_cstr(STR(GCOBJ(mode)));
+	int flags;
+	if (!strcmp(m, "r"))
+		flags = O_RDONLY;
+	else if (!strcmp(m, "w"))
+		flags = O_WRONLY | O_CREAT | O_TRUNC;
+	else if (!strcmp(m, "a"))
+		flags = O_WRONLY | O_CREAT | O_APPEND;
+	else if (!strcmp(m, "r+"))
+		flags = O_RDWR;
+	else if (!strcmp(m, "w+"))
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	else if (!strcmp(m, "a+"))
+		flags = O_RDWR | O_CREAT | O_APPEND;
+	else
+		kk_runtime_error("Unknown file mode \"%s\".", m);
+
+	int fd = open(kk_string_cstr(STR(GCOBJ(path))), flags, 0666);
+
+	kk_gcobj_dec(&path);
+	kk_gcobj_dec(&mode);
+
+	if (fd < 0)
+		PUSH(null, char, 0);
+	else
+		PUSH(gcobj, ptr, kk_stream_new(fd, 1));
+}
+
+// stdin is a single file kept alive for the whole run, so its buffer isn't
+// lost between uses.
+void kk_BUILTIN_stdin(void) {
+	if (!kk_stdin)
+		kk_stdin = kk_stream_new(STDIN_FILENO, 0);
+
+	PUSH(gcobj, ptr, kk_stdin);
+	kk_stdin->refs++;
+}
+
+void kk_BUILTIN_read(void) {
+	kk_top_stream("read");
+	kk_gcobj *o = kk_stream_read_all(GCOBJ(*stack));
+
+	kk_gcobj_dec(stack);
+	*stack = kk_cell_gcobj(o);
+}
+
+void kk_BUILTIN_readl(void) {
+	kk_stream *f = kk_top_stream("readl");
+	kk_gcobj *o = NULL;
+
+	while (f->pos < f->len || kk_stream_fill(f)) {
+		char *start = f->buf + f->pos;
+		char *nl = memchr(start, '\n', f->len - f->pos);
+		size_t n = nl ? (size_t)(nl - start) : f->len - f->pos;
+
+		if (o)
+			kk_string_append(STR(o), start, n);
+		else
+			o = kk_string_new(start, n);
+
+		f->pos += n;
+		if (nl) {
+			f->pos++;
+			break;
+		}
+	}
+
+	kk_gcobj_dec(stack);
+	*stack = o ? kk_cell_gcobj(o) : KK_NULL;
+}
+
+void kk_BUILTIN_readb(void) {
+	kk_stream *f = kk_top_stream("readb");
+
+	kk_cell res = KK_NULL;
+	if (f->pos < f->len || kk_stream_fill(f))
+		res = kk_cell_int((unsigned char)f->buf[f->pos++]);
+
+	kk_gcobj_dec(stack);
+	*stack = res;
+}
+
 void kk_BUILTIN_abs(void) {
-	if (stack->type != kk_type_float)
-		kk_runtime_error("Cannot abs a %s.", type_strs[stack->type]);
+	if (KK_IS_INT(*stack)) {
+		if (KK_INT(*stack) < 0)
+			*stack = kk_cell_int64(-(int64_t)KK_INT(*stack));
+		return;
+	}
 
-	if (stack->float_val < 0)
-		stack->float_val *= -1;
+	if (!KK_IS_FLOAT(*stack))
+		kk_runtime_error("Cannot abs a %s.", type_strs[kk_cell_abstype(*stack)]);
+
+	if (KK_FLOAT(*stack) < 0)
+		*stack = kk_cell_float(-KK_FLOAT(*stack));
 }
 
 void kk_BUILTIN_and(void) {
@@ -978,68 +3288,55 @@ void kk_BUILTIN_cpy(void) {
 	kk_cell_copy(cell, stack++);
 }
 
+// The copy is built directly instead of from a cpy, which would make the
+// original share its data. Each child is copied the way cpy copies it.
 void kk_BUILTIN_rcpy() {
 	kk_cell *cell = stack + 1;
 
-	kk_cell_copy(cell, stack);
+	if (!KK_IS_GCOBJ(*stack)) {
+		*cell = *stack;
+		stack++;
+		return;
+	}
+
+	kk_gcobj *so = GCOBJ(*stack);
+	kk_gcobj *o;
 
-	switch (kk_cell_abstype(*cell)) {
+	switch (so->type) {
 	case kk_type_array:;
-		kk_array
-			*aa = (kk_array *)GCOBJ(*cell)->ptr_val,
-			*ba = (kk_array *)GCOBJ(*stack)->ptr_val;
-
-		for (int i=0; i < aa->len; i++)
-			kk_cell_copy(&aa->data[i], &ba->data[i]);
+		kk_array *sa = (kk_array *)so->ptr_val;
+		o = kk_array_new(sa->len);
+		for (int i=0; i < sa->len; i++)
+			kk_cell_copy(&((kk_array *)o->ptr_val)->data[i], &sa->data[i]);
 		break;
 	case kk_type_cons:
-		kk_cell_copy(&CONS(GCOBJ(*cell))->car, &CONS(GCOBJ(*stack))->car);
-		kk_cell_copy(&CONS(GCOBJ(*cell))->cdr, &CONS(GCOBJ(*stack))->cdr);
-	}
-	stack++;
-}
-
-int main() {
-	strcpy(kk_file, "test.kk");
-	kk_line = 2 ;
-	PUSH(null, char, 0);
-	{
-		kk_gcobj *tmp = malloc(sizeof(kk_gcobj));
-		if (!tmp) kk_runtime_error("Could not allocate a gc object.");
-		tmp->type = kk_type_string; tmp->refs = 1; 
-		tmp->ptr_val = malloc(7 );
-		if (!tmp->ptr_val) kk_runtime_error("Could not allocate a string.");
-		((char *)tmp->ptr_val)[6 ] = 0;
-		strcpy(tmp->ptr_val, "string");
-		PUSH(gcobj, ptr, tmp);
+		o = kk_gcobj_new(kk_type_cons, sizeof(kk_cons));
+		kk_cell_copy(&CONS(o)->car, &CONS(so)->car);
+		kk_cell_copy(&CONS(o)->cdr, &CONS(so)->cdr);
+		break;
+	case kk_type_table:;
+		kk_table *st = TABLE(so);
+		if (st->old)
+			kk_table_migrate(st, st->old_cap);
+
+		o = kk_table_new();
+		for (int i=0; i < st->cap; i++) {
+			kk_table_item *it = &st->items[i];
+			if (!it->hash)
+				continue;
+
+			kk_cell key = it->key, val;
+			kk_gcobj_inc(&key);
+			kk_cell_copy(&val, &it->val);
+			kk_table_set(TABLE(o), key, val);
+		}
+		break;
+	default:
+		kk_cell_copy(cell, stack);
+		stack++;
+		return;
 	}
 
-	kk_BUILTIN_stoa();
-
-	kk_line = 4 ;
-	kk_BUILTIN_cpy();
-
-	kk_line = 6 ;
-	PUSH(float, float, 0 );
-	kk_BUILTIN_get();
-
-	PUSH(float, float, 0 );
-	PUSH(char, char, 'b' );
-	kk_BUILTIN_s__BIGGER__();
-	kk_BUILTIN_set();
-	kk_BUILTIN_s__BIGGER__();
-
-	PUSH(float, float, 0 );
-	kk_BUILTIN_swap();
-	kk_BUILTIN_set();
-
-	kk_line = 8 ;
-	kk_BUILTIN_s__BIGGER__();
-
-	kk_gcobj_dec(stack);
-	POP();
-	kk_gcobj_dec(stack);
-	POP();
-	kk_line = 9 ;
-
+	*cell = kk_cell_gcobj(o);
+	stack++;
 }